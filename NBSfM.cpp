@@ -15,18 +15,110 @@ NBSfM::NBSfM(int argc, char *argv[]) :
     redo_feature_detection_(false),
     redo_feature_matching_(false),
 
+    max_num_features_(20000),
+    quality_level_(1e-10),
+    min_distance_(5),
+    block_size_(10),
+
+    tracker_type_("klt"),
+    window_size_(21),
+    max_level_(3),
+    bidirectional_threshold_(0.1),
+    is_use_selective_backward_(false),
+    forward_error_threshold_(4.0),
+    audit_rate_(0.05),
+    is_use_pruning_(false),
+
+    is_use_sparse_tracks_(false),
+    min_track_length_(2),
+    track_folder_path_("./tracks"),
+
+    is_use_roi_(false),
+    roi_mask_path_(""),
+
+    is_use_camera_(false),
+    camera_path_("./camera.yml"),
+    undistorted_matched_feature_folder_path_("./matched_features_undistorted"),
+    undistorted_track_folder_path_("./tracks_undistorted"),
+
+    is_use_chunks_(false),
+    is_use_merge_chunks_(false),
+    chunk_size_(30),
+    chunk_overlap_(5),
+    num_chunk_processes_(0),
+    link_threshold_(1.0),
+    chunk_folder_path_("./chunks"),
+
+    is_use_benchmark_(false),
+    benchmark_num_frames_(10),
+
+    is_use_sweep_(false),
+    sweep_grid_path_(""),
+
+    is_use_stream_(false),
+    stream_source_(""),
+    stream_idle_timeout_(10),
+
     num_features_(0),
-    num_matched_features_(0) {
+    num_matched_features_(0),
+    num_tracks_(0),
+    stream_watch_fd_(-1) {
   if (!CheckParameters(argc, argv)) {
     exit(-1);
   }
 
   ShowParameters();
 
+  if (is_use_benchmark_) {
+    if (!RunBenchmark()) {
+      exit(-1);
+    }
+    return;
+  }
+
+  if (is_use_stream_) {
+    if (!RunStream()) {
+      exit(-1);
+    }
+    return;
+  }
+
+  if (is_use_merge_chunks_) {
+    if (!MergeChunks() || !WriteTracks(track_folder_path_, track_points_)) {
+      exit(-1);
+    }
+    if (is_use_camera_ && !UndistortMergedTracks()) {
+      exit(-1);
+    }
+    return;
+  }
+
   if (is_use_video_) {
     ExportVideoFrames();
   }
 
+  if (is_use_sweep_) {
+    if (!RunSweep()) {
+      exit(-1);
+    }
+    return;
+  }
+
+  if (is_use_chunks_) {
+    if (!MakeChunks()) {
+      exit(-1);
+    }
+    if (num_chunk_processes_ > 0) {
+      if (!RunChunks() || !MergeChunks() || !WriteTracks(track_folder_path_, track_points_)) {
+        exit(-1);
+      }
+      if (is_use_camera_ && !UndistortMergedTracks()) {
+        exit(-1);
+      }
+    }
+    return;
+  }
+
   LoadImages();
   WriteReferenceImage();
 
@@ -40,19 +132,55 @@ NBSfM::NBSfM(int argc, char *argv[]) :
   }
 
   if (redo_feature_matching_) {
-    FeatureMatching();
-    WriteFeatures();
-    WriteMatchedFeatures();
+    if (!FeatureMatching()) {
+      cerr << "Cannot match features." << endl;
+      exit(-1);
+    }
+    bool is_written = WriteFeatures() &&
+                      ((is_use_sparse_tracks_) ? WriteTracks(track_folder_path_, track_points_) :
+                       WriteMatchedFeatures(matched_feature_folder_path_, matched_features_));
+    if (!is_written) {
+      cerr << "Cannot write matching results." << endl;
+      exit(-1);
+    }
+  } else if (is_use_sparse_tracks_) {
+    if (!LoadTracks()) {
+      cerr << "Cannot load tracks." << endl;
+      exit(-1);
+    }
   } else {
     if (!LoadMatchedFeatures()) {
       cerr << "Cannot load matched features." << endl;
       exit(-1);
     }
   }
+
+  if (is_use_camera_) {
+    if (!LoadCamera() || !Undistortion()) {
+      cerr << "Cannot undistort features." << endl;
+      exit(-1);
+    }
+    bool is_written = (is_use_sparse_tracks_) ?
+                      WriteTracks(undistorted_track_folder_path_, undistorted_track_points_) :
+                      WriteMatchedFeatures(undistorted_matched_feature_folder_path_, undistorted_matched_features_);
+    if (!is_written) {
+      cerr << "Cannot write undistorted features." << endl;
+      exit(-1);
+    }
+  }
   WriteFeatureImage();
 }
 
 bool NBSfM::CheckParameters(int argc, char * argv[]) {
+  // Modes which change what a workspace has to contain
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--sparse_tracks") == 0) {
+      is_use_sparse_tracks_ = true;
+    }
+  }
+
+  program_path_.assign(argv[0]);
+
   int index = 1;
   while (index < argc) {
     if (index + 1 < argc && strcmp(argv[index], "--workspace_path") == 0) {
@@ -172,6 +300,195 @@ bool NBSfM::CheckParameters(int argc, char * argv[]) {
     } else if (index < argc && strcmp(argv[index], "--redo_feature_matching") == 0) {
       redo_feature_matching_ = true;
       index += 1;
+    } else if (index + 1 < argc && strcmp(argv[index], "--max_num_features") == 0) {
+      max_num_features_ = atoi(argv[index + 1]);
+      if (max_num_features_ < 1) {
+        cerr << "max_num_features must be positive." << endl;
+        return false;
+      }
+      index += 2;
+    } else if (index + 1 < argc && strcmp(argv[index], "--quality_level") == 0) {
+      quality_level_ = strtod(argv[index + 1], NULL);
+      if (quality_level_ <= 0) {
+        cerr << "quality_level must be positive." << endl;
+        return false;
+      }
+      index += 2;
+    } else if (index + 1 < argc && strcmp(argv[index], "--min_distance") == 0) {
+      min_distance_ = strtod(argv[index + 1], NULL);
+      if (min_distance_ < 0) {
+        cerr << "min_distance must not be negative." << endl;
+        return false;
+      }
+      index += 2;
+    } else if (index + 1 < argc && strcmp(argv[index], "--block_size") == 0) {
+      block_size_ = atoi(argv[index + 1]);
+      if (block_size_ < 1) {
+        cerr << "block_size must be positive." << endl;
+        return false;
+      }
+      index += 2;
+    } else if (index + 1 < argc && strcmp(argv[index], "--tracker") == 0) {
+      tracker_type_.assign(argv[index + 1]);
+      if (tracker_type_ != "klt" && tracker_type_ != "dense") {
+        cerr << "tracker must be klt or dense." << endl;
+        return false;
+      }
+      index += 2;
+    } else if (index + 1 < argc && strcmp(argv[index], "--window_size") == 0) {
+      window_size_ = atoi(argv[index + 1]);
+      if (window_size_ < 3) {
+        cerr << "window_size must not be less than 3." << endl;
+        return false;
+      }
+      index += 2;
+    } else if (index + 1 < argc && strcmp(argv[index], "--max_level") == 0) {
+      max_level_ = atoi(argv[index + 1]);
+      if (max_level_ < 0) {
+        cerr << "max_level must not be negative." << endl;
+        return false;
+      }
+      index += 2;
+    } else if (index + 1 < argc && strcmp(argv[index], "--bidirectional_threshold") == 0) {
+      bidirectional_threshold_ = strtod(argv[index + 1], NULL);
+      if (bidirectional_threshold_ <= 0) {
+        cerr << "bidirectional_threshold must be positive." << endl;
+        return false;
+      }
+      index += 2;
+    } else if (index + 1 < argc && strcmp(argv[index], "--backward_check") == 0) {
+      if (strcmp(argv[index + 1], "all") == 0) {
+        is_use_selective_backward_ = false;
+      } else if (strcmp(argv[index + 1], "selective") == 0) {
+        is_use_selective_backward_ = true;
+      } else {
+        cerr << "backward_check must be all or selective." << endl;
+        return false;
+      }
+      index += 2;
+      if (index < argc && string(argv[index]).compare(0, 2, "--") != 0) {
+        forward_error_threshold_ = strtod(argv[index], NULL);
+        if (forward_error_threshold_ < 0) {
+          cerr << "error_threshold must not be negative." << endl;
+          return false;
+        }
+        index += 1;
+      }
+      if (index < argc && string(argv[index]).compare(0, 2, "--") != 0) {
+        audit_rate_ = strtod(argv[index], NULL);
+        if (audit_rate_ < 0 || audit_rate_ > 1) {
+          cerr << "audit_rate must be in [0, 1]." << endl;
+          return false;
+        }
+        index += 1;
+      }
+    } else if (index < argc && strcmp(argv[index], "--prune_features") == 0) {
+      is_use_pruning_ = true;
+      index += 1;
+    } else if (index + 1 < argc && strcmp(argv[index], "--sparse_tracks") == 0 &&
+               string(argv[index + 1]).compare(0, 2, "--") != 0) {
+      min_track_length_ = atoi(argv[index + 1]);
+      if (min_track_length_ < 1) {
+        cerr << "min_track_length must be positive." << endl;
+        return false;
+      }
+      index += 2;
+    } else if (index < argc && strcmp(argv[index], "--sparse_tracks") == 0) {
+      index += 1;
+    } else if (index + 1 < argc && strcmp(argv[index], "--track_folder") == 0) {
+      track_folder_path_.assign(argv[index + 1]);
+      if (!CheckTracks()) {
+        return false;
+      }
+      index += 2;
+    } else if (index + 4 < argc && strcmp(argv[index], "--roi") == 0 &&
+               string(argv[index + 2]).compare(0, 2, "--") != 0 &&
+               string(argv[index + 3]).compare(0, 2, "--") != 0 &&
+               string(argv[index + 4]).compare(0, 2, "--") != 0) {
+      roi_ = Rect(atoi(argv[index + 1]), atoi(argv[index + 2]),
+                  atoi(argv[index + 3]), atoi(argv[index + 4]));
+      if (roi_.x < 0 || roi_.y < 0 || roi_.width < 1 || roi_.height < 1) {
+        cerr << "roi must be x y width height inside the images." << endl;
+        return false;
+      }
+      roi_mask_path_.clear();
+      is_use_roi_ = true;
+      index += 5;
+    } else if (index + 1 < argc && strcmp(argv[index], "--roi") == 0) {
+      roi_mask_path_.assign(argv[index + 1]);
+      if (!IsFileReadable(roi_mask_path_)) {
+        cerr << "Cannot read roi mask : " << roi_mask_path_ << "." << endl;
+        return false;
+      }
+      is_use_roi_ = true;
+      index += 2;
+    } else if (index + 1 < argc && strcmp(argv[index], "--camera") == 0) {
+      camera_path_.assign(argv[index + 1]);
+      if (!IsFileReadable(camera_path_)) {
+        cerr << "Cannot read camera : " << camera_path_ << "." << endl;
+        return false;
+      }
+      is_use_camera_ = true;
+      index += 2;
+    } else if (index + 2 < argc && strcmp(argv[index], "--chunks") == 0) {
+      chunk_size_ = atoi(argv[index + 1]);
+      chunk_overlap_ = atoi(argv[index + 2]);
+      if (chunk_size_ < 2 || chunk_overlap_ < 1 || chunk_overlap_ >= chunk_size_) {
+        cerr << "chunk_size must not be less than 2 and overlap must be in [1, chunk_size)." << endl;
+        return false;
+      }
+      index += 3;
+      if (index < argc && string(argv[index]).compare(0, 2, "--") != 0) {
+        num_chunk_processes_ = atoi(argv[index]);
+        if (num_chunk_processes_ < 0) {
+          cerr << "num_processes must not be negative." << endl;
+          return false;
+        }
+        index += 1;
+      }
+      is_use_chunks_ = true;
+    } else if (index < argc && strcmp(argv[index], "--merge_chunks") == 0) {
+      is_use_merge_chunks_ = true;
+      index += 1;
+    } else if (index + 1 < argc && strcmp(argv[index], "--link_threshold") == 0) {
+      link_threshold_ = strtod(argv[index + 1], NULL);
+      if (link_threshold_ <= 0) {
+        cerr << "link_threshold must be positive." << endl;
+        return false;
+      }
+      index += 2;
+    } else if (index + 1 < argc && strcmp(argv[index], "--benchmark") == 0 &&
+               string(argv[index + 1]).compare(0, 2, "--") != 0) {
+      benchmark_num_frames_ = atoi(argv[index + 1]);
+      if (benchmark_num_frames_ < 2) {
+        cerr << "Benchmark requires at least 2 frames." << endl;
+        return false;
+      }
+      is_use_benchmark_ = true;
+      index += 2;
+    } else if (index < argc && strcmp(argv[index], "--benchmark") == 0) {
+      is_use_benchmark_ = true;
+      index += 1;
+    } else if (index + 1 < argc && strcmp(argv[index], "--sweep") == 0) {
+      sweep_grid_path_.assign(argv[index + 1]);
+      if (!IsFileReadable(sweep_grid_path_)) {
+        cerr << "Cannot read sweep grid : " << sweep_grid_path_ << "." << endl;
+        return false;
+      }
+      is_use_sweep_ = true;
+      index += 2;
+    } else if (index + 1 < argc && strcmp(argv[index], "--stream") == 0) {
+      stream_source_.assign(argv[index + 1]);
+      is_use_stream_ = true;
+      index += 2;
+      if (index < argc && string(argv[index]).compare(0, 2, "--") != 0) {
+        stream_idle_timeout_ = strtod(argv[index], NULL);
+        if (stream_idle_timeout_ <= 0) {
+          cerr << "idle_timeout must be positive." << endl;
+          return false;
+        }
+        index += 1;
+      }
     } else {
       Help(argc, argv);
       return false;
@@ -182,6 +499,22 @@ bool NBSfM::CheckParameters(int argc, char * argv[]) {
     cerr << "Cannot write on workspace_path : " << workspace_path_ << "." << endl;
     return false;
   }
+  if (is_use_benchmark_) {
+    // Benchmark renders its own images
+    return true;
+  }
+  if (is_use_stream_) {
+    // Frames come from the stream
+    return true;
+  }
+  if (is_use_sweep_ && tracker_type_ != "klt") {
+    cerr << "Sweep shares KLT pyramids and requires tracker klt." << endl;
+    return false;
+  }
+  if (is_use_merge_chunks_) {
+    // Merging reads only the chunk results
+    return true;
+  }
   if (is_use_images_) {
     if (image_paths_.size() < 2) {
         cerr << "At least 2 images are required." << endl;
@@ -207,6 +540,10 @@ bool NBSfM::CheckParameters(int argc, char * argv[]) {
     return false;
   }
 
+  if (is_use_roi_) {
+    // Features in the workspace may be outside of the region
+    redo_feature_detection_ = true;
+  }
   if (redo_feature_detection_) {
     redo_feature_matching_ = true;
   }
@@ -233,13 +570,74 @@ void NBSfM::ShowParameters() {
   }
   cout << "            feature_folder : " << feature_folder_path_ << endl;
   cout << "    matched_feature_folder : " << matched_feature_folder_path_ << endl;
+  if (is_use_camera_) {
+  cout << "                    camera : " << camera_path_ << endl;
+  }
+  if (is_use_roi_ && roi_mask_path_.empty()) {
+  cout << "                       roi : " << roi_.x << " " << roi_.y << " "
+                                          << roi_.width << " " << roi_.height << endl;
+  } else if (is_use_roi_) {
+  cout << "                       roi : " << roi_mask_path_ << endl;
+  }
+  if (is_use_sparse_tracks_) {
+  cout << "              track_folder : " << track_folder_path_ << endl;
+  cout << "          min_track_length : " << min_track_length_ << endl;
+  }
   cout << endl;
   cout << "                 Recalculate each step" << endl;
   cout << "    redo_feature_detection : " << ((redo_feature_detection_) ? "true" : "false") << endl;
   cout << "     redo_feature_matching : " << ((redo_feature_matching_) ? "true" : "false") << endl;
+  cout << endl;
+  cout << "                   Feature detection" << endl;
+  cout << "          max_num_features : " << max_num_features_ << endl;
+  cout << "             quality_level : " << quality_level_ << endl;
+  cout << "              min_distance : " << min_distance_ << endl;
+  cout << "                block_size : " << block_size_ << endl;
+  cout << endl;
+  cout << "                    Feature matching" << endl;
+  cout << "                   tracker : " << tracker_type_ << endl;
+  cout << "               window_size : " << window_size_ << endl;
+  cout << "                 max_level : " << max_level_ << endl;
+  cout << "   bidirectional_threshold : " << bidirectional_threshold_ << endl;
+  cout << "            backward_check : " << ((is_use_selective_backward_) ? "selective" : "all") << endl;
+  cout << "            prune_features : " << ((is_use_pruning_) ? "true" : "false") << endl;
+  if (is_use_selective_backward_) {
+  cout << "   forward_error_threshold : " << forward_error_threshold_ << endl;
+  cout << "                audit_rate : " << audit_rate_ << endl;
+  }
+  if (is_use_chunks_ || is_use_merge_chunks_) {
+  cout << endl;
+  cout << "                         Chunks" << endl;
+  cout << "              chunk_folder : " << chunk_folder_path_ << endl;
+    if (is_use_chunks_) {
+  cout << "                chunk_size : " << chunk_size_ << endl;
+  cout << "             chunk_overlap : " << chunk_overlap_ << endl;
+  cout << "             num_processes : " << num_chunk_processes_ << endl;
+    }
+  cout << "            link_threshold : " << link_threshold_ << endl;
+  }
+  if (is_use_benchmark_) {
+  cout << endl;
+  cout << "                       Benchmark" << endl;
+  cout << "      benchmark_num_frames : " << benchmark_num_frames_ << endl;
+  }
+  if (is_use_sweep_) {
+  cout << endl;
+  cout << "                         Sweep" << endl;
+  cout << "                sweep_grid : " << sweep_grid_path_ << endl;
+  }
+  if (is_use_stream_) {
+  cout << endl;
+  cout << "                         Stream" << endl;
+  cout << "                    source : " << stream_source_ << endl;
+  cout << "              idle_timeout : " << stream_idle_timeout_ << endl;
+  }
 }
 
 bool NBSfM::CheckWorkspace() {
+  // Remove outputs of runs which died while writing
+  WorkspaceWriter::RemoveStale(workspace_path_);
+
   // Check images
   image_folder_path_.assign(workspace_path_ + "/images");
   if (IsFolderExist(image_folder_path_) && IsFileReadable(image_folder_path_)) {
@@ -258,6 +656,19 @@ bool NBSfM::CheckWorkspace() {
   // Check matched_features
   matched_feature_folder_path_.assign(workspace_path_ + "/matched_features");
   CheckMatchedFeatures();
+
+  // Check tracks
+  track_folder_path_.assign(workspace_path_ + "/tracks");
+  CheckTracks();
+
+  // Chunks
+  chunk_folder_path_.assign(workspace_path_ + "/chunks");
+
+  // Check camera
+  camera_path_.assign(workspace_path_ + "/camera.yml");
+  is_use_camera_ = IsFileReadable(camera_path_);
+  undistorted_matched_feature_folder_path_.assign(workspace_path_ + "/matched_features_undistorted");
+  undistorted_track_folder_path_.assign(workspace_path_ + "/tracks_undistorted");
   return true;
 }
 
@@ -310,9 +721,13 @@ bool NBSfM::CheckFeatures() {
     num_features_ = 0;
     feature_paths_.clear();
 
-    // Try to read feature files
+    // Try to read feature files. Sparse tracks keep only the features of the reference image.
+    unsigned int num_feature_images = image_names_.size();
+    if (is_use_sparse_tracks_) {
+      num_feature_images = min(num_feature_images, 1u);
+    }
     int feature_count = 0;
-    for (unsigned int i = 0; i < image_names_.size(); i++) {
+    for (unsigned int i = 0; i < num_feature_images; i++) {
       string feature_path = feature_folder_path_ + "/" + image_names_[i] + ".csv";
       if (!IsFileReadable(feature_path)) {
         // Cannot read feature file
@@ -336,6 +751,10 @@ bool NBSfM::CheckFeatures() {
 }
 
 bool NBSfM::CheckMatchedFeatures() {
+  if (is_use_sparse_tracks_) {
+    // Tracks replace matched features
+    return true;
+  }
   bool is_can_read = IsFolderExist(matched_feature_folder_path_) && IsFileReadable(matched_feature_folder_path_);
   bool is_can_write = IsFolderExist(matched_feature_folder_path_) && IsFileWritable(matched_feature_folder_path_);
 
@@ -369,6 +788,23 @@ bool NBSfM::CheckMatchedFeatures() {
   return true;
 }
 
+bool NBSfM::CheckTracks() {
+  if (!is_use_sparse_tracks_) {
+    return true;
+  }
+  bool is_can_read = IsFolderExist(track_folder_path_) && IsFileReadable(track_folder_path_ + "/tracks.csv");
+  bool is_can_write = !IsFolderExist(track_folder_path_) || IsFileWritable(track_folder_path_);
+
+  if (!is_can_read) {
+    if (!is_can_write) {
+      cerr << "Need to track features but cannot write tracks to track_folder : " << track_folder_path_ << endl;
+      return false;
+    }
+    redo_feature_matching_ = true;
+  }
+  return true;
+}
+
 void NBSfM::Help(int argc, char *argv[]) {
   cout << "Usage : " << argv[0] << " [Parameters]" << endl;
   cout << "Parameters : (a duplicate parameter overrides previous one)" << endl;
@@ -379,10 +815,58 @@ void NBSfM::Help(int argc, char *argv[]) {
   cout << "    [--video video_path [image_folder_path] [max_num_frames]]" << endl;
   cout << "    [--feature_folder feature_folder]" << endl;
   cout << "    [--matched_feature_folder matched_feature_folder]" << endl;
+  cout << "    [--roi x y width height | --roi mask_path] (track only inside, output in full image coordinates)" << endl;
+  cout << "                                               (features are detected again)" << endl;
+  cout << "    [--camera camera_path] (camera_matrix and distortion_coefficients," << endl;
+  cout << "                            default workspace_path/camera.yml if exists)" << endl;
   cout << endl;
   cout << "  Recalculate each step. The following steps will be calculated also." << endl;
   cout << "    [--redo_feature_detection]" << endl;
   cout << "    [--redo_feature_matching]" << endl;
+  cout << endl;
+  cout << "  Feature detection" << endl;
+  cout << "    [--max_num_features max_num_features] (default 20000)" << endl;
+  cout << "    [--quality_level quality_level] (default 1e-10)" << endl;
+  cout << "    [--min_distance min_distance] (default 5)" << endl;
+  cout << "    [--block_size block_size] (default 10)" << endl;
+  cout << endl;
+  cout << "  Feature matching" << endl;
+  cout << "    [--tracker klt|dense] (default klt, dense uses DIS optical flow)" << endl;
+  cout << "    [--window_size window_size] (default 21)" << endl;
+  cout << "    [--max_level max_level] (default 3)" << endl;
+  cout << "    [--bidirectional_threshold bidirectional_threshold] (default 0.1)" << endl;
+  cout << "    [--backward_check all|selective [error_threshold [audit_rate]]] (default all)" << endl;
+  cout << "      selective tracks backward only features with a forward error above" << endl;
+  cout << "      error_threshold (default 4) and a random audit_rate (default 0.05) of the others." << endl;
+  cout << "    [--prune_features] (stop tracking features once they fail, their features are nan)" << endl;
+  cout << endl;
+  cout << "  Sparse tracks. Keep features which are tracked on at least min_track_length" << endl;
+  cout << "  consecutive images from the reference image, instead of on all images." << endl;
+  cout << "    [--sparse_tracks [min_track_length]] (default 2)" << endl;
+  cout << "    [--track_folder track_folder]" << endl;
+  cout << endl;
+  cout << "  Chunks. Split images into overlapping chunks of chunk_size images, each" << endl;
+  cout << "  a workspace in workspace_path/chunks which can be run as an independent job." << endl;
+  cout << "  With num_processes, run chunks locally and merge their tracks." << endl;
+  cout << "    [--chunks chunk_size overlap [num_processes]]" << endl;
+  cout << "    [--merge_chunks]" << endl;
+  cout << "    [--link_threshold link_threshold] (default 1.0)" << endl;
+  cout << endl;
+  cout << "  Benchmark. Render synthetic scenes and write benchmark.csv to workspace_path." << endl;
+  cout << "    [--benchmark [num_frames]] (default 10)" << endl;
+  cout << endl;
+  cout << "  Sweep. Track with every combination of a parameter grid, decoding images and" << endl;
+  cout << "  building pyramids once, and write each to workspace_path/sweep/<combination>." << endl;
+  cout << "  Each line of sweep_grid is name,value_1,value_2,... for max_num_features," << endl;
+  cout << "  quality_level, min_distance, block_size, window_size, max_level or" << endl;
+  cout << "  bidirectional_threshold." << endl;
+  cout << "    [--sweep sweep_grid] (requires tracker klt)" << endl;
+  cout << endl;
+  cout << "  Stream. Detect on the first frame of source and write the features of each" << endl;
+  cout << "  frame to workspace_path/stream as soon as it is tracked. source is a camera" << endl;
+  cout << "  index, a video file or named pipe, or a folder which images are added to," << endl;
+  cout << "  which ends after idle_timeout seconds without a new image." << endl;
+  cout << "    [--stream source [idle_timeout]] (default 10)" << endl;
 }
 
 inline bool NBSfM::EndsWith(std::string const & value, std::string const & ending) {
@@ -394,6 +878,9 @@ inline bool NBSfM::EndsWith(std::string const & value, std::string const & endin
 
 void NBSfM::ReadDirectory(const std::string& name, StringVec& v) {
   DIR* dirp = opendir(name.c_str());
+  if (dirp == NULL) {
+    return;
+  }
   struct dirent * dp;
   while ((dp = readdir(dirp)) != NULL) {
     v.push_back(dp->d_name);
@@ -402,10 +889,8 @@ void NBSfM::ReadDirectory(const std::string& name, StringVec& v) {
 }
 
 bool NBSfM::MakeDir(string path) {
-  string mkdir_cmd = "mkdir -p " + path;
-  const int dir_err = system(mkdir_cmd.c_str());
-  if (-1 == dir_err) {
-    cerr << "Error creating directory!n";
+  if (!WorkspaceWriter::MakeDir(path)) {
+    cerr << "Error creating directory : " << path << endl;
     return false;
   }
   return true;
@@ -497,6 +982,54 @@ bool NBSfM::CSVStr2Mat(vector< vector < string > > data, Mat& mat) {
   return true;
 }
 
+bool NBSfM::ReadTracks(string track_path, int num_images, vector< int >& first_frames,
+                       vector< int >& offsets, vector< Point2f >& points) {
+  first_frames.clear();
+  offsets.assign(1, 0);
+  points.clear();
+
+  // Each line is first_frame,length,x_0,y_0,x_1,y_1,...
+  ifstream file(track_path);
+  if (!file.is_open()) {
+    return false;
+  }
+  string line;
+  while (getline(file, line)) {
+    if (line.empty()) {
+      continue;
+    }
+    istringstream ss(line);
+    string elem;
+    if (!getline(ss, elem, ',')) {
+      return false;
+    }
+    int first_frame = atoi(elem.c_str());
+    if (!getline(ss, elem, ',')) {
+      return false;
+    }
+    int length = atoi(elem.c_str());
+    if (first_frame < 0 || length < 1 || first_frame + length > num_images) {
+      return false;
+    }
+    for (int k = 0; k < length; k++) {
+      Point2f p;
+      if (!getline(ss, elem, ',')) {
+        return false;
+      }
+      p.x = strtod(elem.c_str(), NULL);
+      if (!getline(ss, elem, ',')) {
+        return false;
+      }
+      p.y = strtod(elem.c_str(), NULL);
+      points.push_back(p);
+    }
+    first_frames.push_back(first_frame);
+    offsets.push_back(points.size());
+  }
+  file.close();
+  return true;
+}
+
 string NBSfM::GetNameFromPath(string path) {
   // Remove directory
   size_t last_slash = path.find_last_of("/");
@@ -557,18 +1090,61 @@ bool NBSfM::LoadImages() {
     if (img_idx == 0) {
       image_width_ = img.cols;
       image_height_ = img.rows;
+      if (!SetROI(img)) {
+        throw runtime_error("Could not use roi.");
+      }
     } else {
       if (image_width_ != img.cols || image_height_ != img.rows) {
         throw runtime_error("An image doesn't have the same size.");
       }
     }
-    images_.push_back(img);
+    if (is_use_roi_) {
+      // Keep only the region of interest
+      images_.push_back(img(roi_).clone());
+    } else {
+      images_.push_back(img);
+    }
     cout << "  " << img_idx + 1 << " / " << num_images_ << endl;
     img_idx++;
   }
   return true;
 }
 
+bool NBSfM::SetROI(const Mat& image) {
+  Rect image_rect(0, 0, image.cols, image.rows);
+  if (!is_use_roi_) {
+    roi_ = image_rect;
+    roi_mask_.release();
+    return true;
+  }
+
+  if (!roi_mask_path_.empty()) {
+    Mat mask = imread(roi_mask_path_, CV_LOAD_IMAGE_GRAYSCALE);
+    if (mask.cols != image.cols || mask.rows != image.rows) {
+      cerr << "  roi mask doesn't have the same size as images." << endl;
+      return false;
+    }
+    Mat mask_points;
+    findNonZero(mask, mask_points);
+    if (mask_points.empty()) {
+      cerr << "  roi mask is empty." << endl;
+      return false;
+    }
+    roi_ = boundingRect(mask_points);
+    roi_mask_ = mask(roi_).clone();
+  } else {
+    roi_ = roi_ & image_rect;
+    roi_mask_.release();
+  }
+  if (roi_.width < 2 || roi_.height < 2) {
+    cerr << "  roi is outside of images." << endl;
+    return false;
+  }
+  cout << "  Region of interest : " << roi_.x << " " << roi_.y << " "
+       << roi_.width << " " << roi_.height << endl;
+  return true;
+}
+
 bool NBSfM::WriteReferenceImage() {
   cout << endl << endl << "Write reference image.." << endl;
   imwrite(workspace_path_ + "/ReferenceImage.png", images_.at(0));
@@ -579,6 +1155,7 @@ bool NBSfM::LoadFeatures() {
   cout << endl << endl << "Load features.." << endl;
   num_features_ = 0;
 
+  int num_feature_images = (is_use_sparse_tracks_) ? 1 : num_images_;
   int feature_count = 0;
   for (auto feature_path : feature_paths_) {
     vector< vector < string > > data_i = ReadCSV(feature_path);
@@ -587,7 +1164,7 @@ bool NBSfM::LoadFeatures() {
 
     if (feature_count == 0) {
       num_features_ = features_i.cols;
-      features_ = Mat::zeros(2 * num_images_, num_features_, CV_64F);
+      features_ = Mat::zeros(2 * num_feature_images, num_features_, CV_64F);
     }
     if (features_i.rows != 2 || features_i.cols != num_features_) {
       return false;
@@ -596,7 +1173,7 @@ bool NBSfM::LoadFeatures() {
     feature_count++;
   }
 
-  if (feature_count != num_images_) {
+  if (feature_count != num_feature_images) {
     return false;
   }
   return true;
@@ -609,13 +1186,15 @@ bool NBSfM::FeatureDetection() {
   cvtColor(image_ref, gray_ref, CV_RGB2GRAY);
 
   vector< Point2f > feature_ref;
-  goodFeaturesToTrack(gray_ref, feature_ref, 20000, 1e-10, 5, noArray(), 10);
+  goodFeaturesToTrack(gray_ref, feature_ref, max_num_features_, quality_level_,
+                      min_distance_, roi_mask_, block_size_);
   num_features_ = feature_ref.size();
 
+  // Store features in full image coordinates
   features_ = Mat::zeros(2, num_features_, CV_64F);
   for (int i = 0; i < num_features_; i++) {
-    features_.at< double >(0, i) = feature_ref[i].x;
-    features_.at< double >(1, i) = feature_ref[i].y;
+    features_.at< double >(0, i) = feature_ref[i].x + roi_.x;
+    features_.at< double >(1, i) = feature_ref[i].y + roi_.y;
   }
   cout << "  Get " << num_features_ << " features." << endl;
   return true;
@@ -624,21 +1203,20 @@ bool NBSfM::FeatureDetection() {
 bool NBSfM::WriteFeatures() {
   cout << endl << endl << "Write feature.." << endl;
 
-  if (IsFolderExist(feature_folder_path_)) {
-    if (!IsFileWritable(feature_folder_path_)) {
-      cout << "Cannot write features." << endl;
-      return false;
-    }
-    // Delete old features
-    string cmd = "rm -r " + feature_folder_path_ + "/*.csv";
-    system(cmd.c_str());
-  } else {
-    MakeDir(feature_folder_path_);
+  if (IsFolderExist(feature_folder_path_) && !IsFileWritable(feature_folder_path_)) {
+    cout << "Cannot write features." << endl;
+    return false;
+  }
+  WorkspaceWriter writer(feature_folder_path_);
+  if (!writer.Begin()) {
+    cout << "Cannot write features." << endl;
+    return false;
   }
 
-  // Write features
-  for (int i = 0; i < num_images_; i++) {
-    string feature_path = feature_folder_path_ + "/" + image_names_[i] + ".csv";
+  // Write features. Sparse tracks keep only the features of the reference image.
+  int num_feature_images = features_.rows / 2;
+  for (int i = 0; i < num_feature_images; i++) {
+    string feature_path = writer.GetPath(image_names_[i] + ".csv");
     int index = i * 2;
     ofstream file(feature_path);
     file << features_.at<double>(index, 0);
@@ -652,8 +1230,13 @@ bool NBSfM::WriteFeatures() {
       file << "," << features_.at<double>(index, j);
     }
     file.close();
+    if (file.fail()) {
+      // Not committed, the old features stay
+      cout << "Cannot write features." << endl;
+      return false;
+    }
   }
-  return true;
+  return writer.Commit();
 }
 
 bool NBSfM::LoadMatchedFeatures() {
@@ -685,122 +1268,561 @@ bool NBSfM::LoadMatchedFeatures() {
 
 bool NBSfM::FeatureMatching() {
   cout << endl << endl << "Feature matching.." << endl;
-
-  // Reference image
-  Mat img_gray_0;
-  cvtColor(images_.at(0), img_gray_0, CV_RGB2GRAY);
-  vector< Point2f > features_0;
-  for (int i = 0; i < num_features_; i++) {
-    features_0.push_back(Point2f(features_.at<double>(0, i),
-                                 features_.at<double>(1, i)));
+  BuildReferencePyramid();
+  InitMatching();
+
+  // Track a batch of images in parallel, one image per worker, then collect them in order.
+  // Pruning tracks one image at a time, parallel over features inside OpenCV,
+  // so that the features to track shrink after every image.
+  int num_workers = (is_use_pruning_) ? 1 : max(1, getNumThreads());
+  tracking_scratch_.resize(num_workers);
+  for (auto& scratch : tracking_scratch_) {
+    scratch.tracker = CreateTracker();
+    scratch.ResetStatistics();
   }
-
-  // Get feature matching
-  Mat mask = Mat::ones(num_images_, num_features_, CV_8U);
-  vector< vector< Point2f > > features;
-  for (int i = 0; i < num_images_; i++) {
-    vector< Point2f > tmp;
-    features.push_back(tmp);
-    Mat img_gray_i;
-    cvtColor(images_.at(i), img_gray_i, CV_RGB2GRAY);
-
-    vector< Point2f > features_forward;
-    vector< Point2f > features_backward;
-    vector< unsigned char > status_forward;
-    vector< unsigned char > status_backward;
-    vector< float > error_forward;
-    vector< float > error_backward;
-
-    calcOpticalFlowPyrLK(img_gray_0, img_gray_i, features_0, features_forward,
-                         status_forward, error_forward);
-    calcOpticalFlowPyrLK(img_gray_i, img_gray_0, features_forward, features_backward,
-                         status_backward, error_backward);
-
-    for (int j = 0; j < num_features_; j++) {
-      // Store features
-      features[i].push_back(features_forward[j]);
-
-      // Compute mask
-      float bidirectional_error = norm(features_0.at(j) - features_backward.at(j));
-      if (status_forward[j] == 0 || status_backward[j] == 0 || bidirectional_error > 0.1) {
-        mask.at<unsigned char>(i, j) = 0;
-      }
+  int num_allocations = 0;
+  int num_steady_allocations = 0;
+  vector< int > batch_allocations(num_workers);
+  for (int batch_start = 0; batch_start < num_images_; batch_start += num_workers) {
+    int batch_size = min(num_workers, num_images_ - batch_start);
+    if (batch_size == 1) {
+      batch_allocations[0] = TrackImage(images_.at(batch_start), batch_start, live_features_,
+                                        tracking_scratch_[0]);
+    } else {
+      ParallelFor(0, batch_size, [&](int w) {
+        batch_allocations[w] = TrackImage(images_.at(batch_start + w), batch_start + w, live_features_,
+                                          tracking_scratch_[w]);
+      });
     }
-  }
 
-  // Filter features which appears on all images
-  Mat count_mask = Mat::zeros(1, num_features_, CV_32S);
-  num_matched_features_ = 0;
-  for (int j = 0; j < num_features_; j++) {
-    int count = 1; // All features are on reference image, no need to count them
-    for (int i = 1; i < num_images_; i++) {
-      if (mask.at<unsigned char>(i, j) == 1) {
-        count++;
+    for (int w = 0; w < batch_size; w++) {
+      num_allocations += batch_allocations[w];
+      if (batch_start > 0) {
+        num_steady_allocations += batch_allocations[w];
       }
+      CollectMatches(batch_start + w, tracking_scratch_[w]);
     }
-    count_mask.at<int>(j) = count;
-    if (count == num_images_) {
-      num_matched_features_++;
+    if (is_use_pruning_) {
+      PruneFeatures(batch_start + batch_size - 1);
     }
   }
-  if (num_matched_features_ < 10) {
-    return false;
+  if (is_use_pruning_) {
+    cout << "  Track " << live_idx_.size() << " / " << num_features_ << " features on the last image." << endl;
   }
+  double forward_time = 0;
+  double backward_time = 0;
+  int num_verified = 0;
+  int num_skipped = 0;
+  int num_audited = 0;
+  int num_audit_failures = 0;
+  for (int w = 0; w < min(num_workers, num_images_); w++) {
+    forward_time += tracking_scratch_[w].forward_time;
+    backward_time += tracking_scratch_[w].backward_time;
+    num_verified += tracking_scratch_[w].num_verified;
+    num_skipped += tracking_scratch_[w].num_skipped;
+    num_audited += tracking_scratch_[w].num_audited;
+    num_audit_failures += tracking_scratch_[w].num_audit_failures;
+  }
+  cout << "  Tracker " << tracking_scratch_[0].tracker->GetName() << " : forward " << forward_time
+       << " s, backward " << backward_time << " s, summed over workers." << endl;
+  cout << "  Backward checks : " << num_verified << " tracked backward, " << num_skipped << " skipped ("
+       << ((num_verified + num_skipped > 0) ? 100.0 * num_skipped / (num_verified + num_skipped) : 0)
+       << " %), " << num_audited << " audited with " << num_audit_failures << " failures." << endl;
+  // Scratch which OpenCV allocates inside cvtColor() and calcOpticalFlowPyrLK()
+  // on every call is not counted here.
+  cout << "  Tracking buffer allocations : " << num_allocations << " in total, "
+       << ((num_images_ > num_workers) ? (double)num_steady_allocations / (num_images_ - num_workers) : 0)
+       << " per image after the first image of each worker." << endl;
+
+  return FinishMatching();
+}
 
-  // Copy features to features_ and matched_features_
-  features_ = Mat::zeros(2 * num_images_, num_features_, CV_64F);
-  matched_features_ = Mat::zeros(2 * num_images_, num_matched_features_, CV_64F);
-  for (int i = 0; i < num_images_; i++) {
-    int index = i * 2;
-    int idx = 0;
-    for (int j = 0; j < num_features_; j++) {
-      Point2f p = features[i][j];
-      features_.at<double>(index,     j) = p.x;
-      features_.at<double>(index + 1, j) = p.y;
-
-      if (count_mask.at<int>(j) == num_images_) {
-        matched_features_.at<double>(index,     idx) = p.x;
-        matched_features_.at<double>(index + 1, idx) = p.y;
-        idx++;
-      }
-    }
+void NBSfM::BuildReferencePyramid() {
+  // Reference image. Its pyramid is shared by all images.
+  cvtColor(images_.at(0), reference_gray_, CV_RGB2GRAY);
+  if (tracker_type_ == "klt") {
+    buildOpticalFlowPyramid(reference_gray_, reference_pyramid_, Size(window_size_, window_size_), max_level_);
   }
-  cout << "  Get " << num_matched_features_ << " tracked features."  << endl;
-  return true;
 }
 
-bool NBSfM::WriteMatchedFeatures() {
-  cout << endl << endl << "Write matched features.." << endl;
+void NBSfM::InitMatching() {
+  reference_features_.resize(num_features_);
+  for (int j = 0; j < num_features_; j++) {
+    reference_features_[j] = Point2f(features_.at<double>(0, j) - roi_.x,
+                                     features_.at<double>(1, j) - roi_.y);
+  }
 
-  if (IsFolderExist(matched_feature_folder_path_)) {
-    if (!IsFileWritable(matched_feature_folder_path_)) {
-      cout << "Cannot write matched features." << endl;
-      return false;
+  // Sparse tracks store only the observations of features which are still tracked.
+  // A feature is still tracked on image i when track_lengths_[j] == i.
+  if (is_use_sparse_tracks_) {
+    track_lengths_.assign(num_features_, 0);
+    observations_.clear();
+  } else {
+    // Every element is written by CollectMatches()
+    features_.create(2 * num_images_, num_features_, CV_64F);
+    match_counts_.assign(num_features_, 0);
+  }
+
+  // All features are tracked on the first image
+  live_idx_.resize(num_features_);
+  for (int j = 0; j < num_features_; j++) {
+    live_idx_[j] = j;
+  }
+  live_features_ = reference_features_;
+}
+
+void NBSfM::CollectMatches(int image_idx, const TrackingScratch& scratch) {
+  // Results are for live features, scatter them back to all features. Tracking
+  // runs on the cropped images, results are in full image coordinates.
+  int i = image_idx;
+  int num_live = live_idx_.size();
+  if (is_use_sparse_tracks_) {
+    Point2f roi_offset(roi_.x, roi_.y);
+    for (int k = 0; k < num_live; k++) {
+      int j = live_idx_[k];
+      if (track_lengths_[j] == i && (i == 0 || scratch.mask[k] != 0)) {
+        observations_.push_back(scratch.features_forward[k] + roi_offset);
+        track_lengths_[j]++;
+      }
+    }
+    return;
+  }
+
+  double * row_x = features_.ptr< double >(2 * i);
+  double * row_y = features_.ptr< double >(2 * i + 1);
+  if (num_live < num_features_) {
+    const double nan = numeric_limits< double >::quiet_NaN();
+    fill(row_x, row_x + num_features_, nan);
+    fill(row_y, row_y + num_features_, nan);
+  }
+  for (int k = 0; k < num_live; k++) {
+    int j = live_idx_[k];
+    row_x[j] = scratch.features_forward[k].x + roi_.x;
+    row_y[j] = scratch.features_forward[k].y + roi_.y;
+    // All features are on reference image, no need to count them
+    if (i > 0 && scratch.mask[k] != 0) {
+      match_counts_[j]++;
+    }
+  }
+}
+
+void NBSfM::PruneFeatures(int last_image) {
+  // Keep features which are still matched on every image so far
+  int num_live = live_idx_.size();
+  int num_kept = 0;
+  for (int k = 0; k < num_live; k++) {
+    int j = live_idx_[k];
+    bool is_live = (is_use_sparse_tracks_) ? track_lengths_[j] == last_image + 1 :
+                                             match_counts_[j] == last_image;
+    if (is_live) {
+      live_idx_[num_kept] = j;
+      live_features_[num_kept] = live_features_[k];
+      num_kept++;
+    }
+  }
+  live_idx_.resize(num_kept);
+  live_features_.resize(num_kept);
+}
+
+bool NBSfM::FinishMatching() {
+  if (is_use_sparse_tracks_) {
+    return BuildTracks(track_lengths_, observations_);
+  }
+
+  // Filter features which appears on all images
+  num_matched_features_ = 0;
+  for (int j = 0; j < num_features_; j++) {
+    if (match_counts_[j] == num_images_ - 1) {
+      num_matched_features_++;
+    }
+  }
+  if (num_matched_features_ < 10) {
+    return false;
+  }
+
+  // Copy matched features to matched_features_
+  matched_features_.create(2 * num_images_, num_matched_features_, CV_64F);
+  for (int r = 0; r < 2 * num_images_; r++) {
+    const double * row = features_.ptr< double >(r);
+    double * matched_row = matched_features_.ptr< double >(r);
+    int idx = 0;
+    for (int j = 0; j < num_features_; j++) {
+      if (match_counts_[j] == num_images_ - 1) {
+        matched_row[idx] = row[j];
+        idx++;
+      }
+    }
+  }
+  cout << "  Get " << num_matched_features_ << " tracked features."  << endl;
+  return true;
+}
+
+Ptr< FeatureTracker > NBSfM::CreateTracker() {
+  Size window_size(window_size_, window_size_);
+  if (tracker_type_ == "dense") {
+    return Ptr< FeatureTracker >(new DenseFlowTracker(reference_gray_, window_size, max_level_));
+  }
+  return Ptr< FeatureTracker >(new KLTTracker(reference_pyramid_, window_size, max_level_));
+}
+
+int NBSfM::TrackImage(const Mat& image, int image_idx, const vector< Point2f >& points,
+                      TrackingScratch& scratch) {
+  // Track points of the reference image to an image and back. Results are
+  // indexed as points. Returns the number of buffers which had to be (re)allocated.
+  if (points.empty()) {
+    // All features are pruned
+    scratch.mask.clear();
+    return 0;
+  }
+  BufferStorage storage_before[TrackingScratch::kNumBuffers];
+  BufferStorage storage_after[TrackingScratch::kNumBuffers];
+  scratch.GetStorage(storage_before);
+  cvtColor(image, scratch.gray, CV_RGB2GRAY);
+
+  double tick = (double)getTickCount();
+  scratch.tracker->Forward(scratch.gray, points, scratch.features_forward,
+                           scratch.status_forward, scratch.error_forward);
+  scratch.forward_time += ((double)getTickCount() - tick) / getTickFrequency();
+  CheckBackward(image_idx, points, scratch);
+
+  scratch.GetStorage(storage_after);
+  int num_allocations = 0;
+  for (int k = 0; k < TrackingScratch::kNumBuffers; k++) {
+    if (storage_before[k].data != storage_after[k].data || storage_before[k].size != storage_after[k].size) {
+      num_allocations++;
+    }
+  }
+  return num_allocations;
+}
+
+void NBSfM::TrackPyramid(int image_idx, const vector< Mat >& pyramid, const vector< Point2f >& points,
+                         TrackingScratch& scratch) {
+  // Same as TrackImage() for an image whose pyramid is already built with
+  // window_size_ and max_level_, with a KLTTracker
+  if (points.empty()) {
+    scratch.mask.clear();
+    return;
+  }
+  Ptr< KLTTracker > tracker = scratch.tracker.dynamicCast< KLTTracker >();
+  double tick = (double)getTickCount();
+  tracker->ForwardPyramid(pyramid, points, scratch.features_forward,
+                          scratch.status_forward, scratch.error_forward);
+  scratch.forward_time += ((double)getTickCount() - tick) / getTickFrequency();
+  CheckBackward(image_idx, points, scratch);
+}
+
+void NBSfM::CheckBackward(int image_idx, const vector< Point2f >& points, TrackingScratch& scratch) {
+  // Compute the mask of forward tracked points
+  int num_points = points.size();
+  double forward_tick = (double)getTickCount();
+  if (!is_use_selective_backward_) {
+    scratch.tracker->Backward(scratch.features_forward, scratch.features_backward,
+                              scratch.status_backward, scratch.error_backward);
+    scratch.backward_time += ((double)getTickCount() - forward_tick) / getTickFrequency();
+    scratch.num_verified += num_points;
+
+    // Compute mask
+    scratch.mask.resize(num_points);
+    for (int j = 0; j < num_points; j++) {
+      float bidirectional_error = norm(points[j] - scratch.features_backward[j]);
+      scratch.mask[j] = (scratch.status_forward[j] != 0 && scratch.status_backward[j] != 0 &&
+                         bidirectional_error <= bidirectional_threshold_) ? 1 : 0;
     }
-    // Delete old features
-    string cmd = "rm " + matched_feature_folder_path_ + "/*.csv";
-    system(cmd.c_str());
   } else {
-    MakeDir(matched_feature_folder_path_);
+    // Accept features with a confident forward error directly, except for a
+    // random audit sample. The sample depends only on the image.
+    RNG rng(image_idx + 1);
+    scratch.mask.resize(num_points);
+    scratch.verify_idx.clear();
+    scratch.verify_points.clear();
+    for (int j = 0; j < num_points; j++) {
+      if (scratch.status_forward[j] == 0) {
+        scratch.mask[j] = 0;
+        continue;
+      }
+      bool is_confident = scratch.error_forward[j] <= forward_error_threshold_;
+      if (!is_confident || rng.uniform(0.f, 1.f) < audit_rate_) {
+        scratch.verify_idx.push_back(j);
+        scratch.verify_points.push_back(scratch.features_forward[j]);
+      } else {
+        scratch.mask[j] = 1;
+        scratch.num_skipped++;
+      }
+    }
+
+    if (!scratch.verify_points.empty()) {
+      scratch.tracker->Backward(scratch.verify_points, scratch.features_backward,
+                                scratch.status_backward, scratch.error_backward);
+    }
+    scratch.backward_time += ((double)getTickCount() - forward_tick) / getTickFrequency();
+    scratch.num_verified += scratch.verify_idx.size();
+
+    for (unsigned int k = 0; k < scratch.verify_idx.size(); k++) {
+      int j = scratch.verify_idx[k];
+      float bidirectional_error = norm(points[j] - scratch.features_backward[k]);
+      scratch.mask[j] = (scratch.status_backward[k] != 0 &&
+                         bidirectional_error <= bidirectional_threshold_) ? 1 : 0;
+      if (scratch.error_forward[j] <= forward_error_threshold_) {
+        scratch.num_audited++;
+        if (scratch.mask[j] == 0) {
+          scratch.num_audit_failures++;
+        }
+      }
+    }
+  }
+}
+
+bool NBSfM::BuildTracks(const vector< int >& track_lengths, const vector< Point2f >& observations) {
+  // Keep tracks which are long enough
+  vector< int > track_index(num_features_, -1);
+  track_first_frames_.clear();
+  track_offsets_.assign(1, 0);
+  num_tracks_ = 0;
+  for (int j = 0; j < num_features_; j++) {
+    if (track_lengths[j] >= min_track_length_) {
+      track_index[j] = num_tracks_;
+      track_first_frames_.push_back(0);
+      track_offsets_.push_back(track_offsets_.back() + track_lengths[j]);
+      num_tracks_++;
+    }
+  }
+  if (num_tracks_ < 10) {
+    return false;
+  }
+
+  // Observations are stored image by image, in feature order, for features which
+  // are still tracked. Scatter them to be contiguous per track.
+  track_points_.resize(track_offsets_.back());
+  vector< int > alive;
+  for (int j = 0; j < num_features_; j++) {
+    if (track_lengths[j] > 0) {
+      alive.push_back(j);
+    }
+  }
+  size_t cursor = 0;
+  for (int i = 0; !alive.empty(); i++) {
+    size_t num_alive = 0;
+    for (auto j : alive) {
+      if (track_lengths[j] <= i) {
+        continue;
+      }
+      if (track_index[j] >= 0) {
+        track_points_[track_offsets_[track_index[j]] + i] = observations[cursor];
+      }
+      cursor++;
+      alive[num_alive++] = j;
+    }
+    alive.resize(num_alive);
+  }
+
+  cout << "  Get " << num_tracks_ << " tracks with " << track_points_.size() << " observations." << endl;
+  return true;
+}
+
+bool NBSfM::LoadTracks() {
+  cout << endl << endl << "Load tracks.." << endl;
+  if (!ReadTracks(track_folder_path_ + "/tracks.csv", num_images_,
+                  track_first_frames_, track_offsets_, track_points_)) {
+    num_tracks_ = 0;
+    return false;
+  }
+  num_tracks_ = track_first_frames_.size();
+  cout << "  Get " << num_tracks_ << " tracks with " << track_points_.size() << " observations." << endl;
+  return true;
+}
+
+bool NBSfM::WriteTracks(string track_folder_path, const vector< Point2f >& track_points) {
+  cout << endl << endl << "Write tracks.." << endl;
+
+  if (IsFolderExist(track_folder_path) && !IsFileWritable(track_folder_path)) {
+    cout << "Cannot write tracks." << endl;
+    return false;
+  }
+  WorkspaceWriter writer(track_folder_path);
+  if (!writer.Begin()) {
+    cout << "Cannot write tracks." << endl;
+    return false;
+  }
+
+  // Write tracks
+  ofstream file(writer.GetPath("tracks.csv"));
+  for (int k = 0; k < num_tracks_; k++) {
+    file << track_first_frames_[k] << "," << track_offsets_[k + 1] - track_offsets_[k];
+    for (int o = track_offsets_[k]; o < track_offsets_[k + 1]; o++) {
+      file << "," << track_points[o].x << "," << track_points[o].y;
+    }
+    file << endl;
+  }
+  file.close();
+  if (file.fail()) {
+    // Not committed, the old tracks stay
+    cout << "Cannot write tracks." << endl;
+    return false;
+  }
+  return writer.Commit();
+}
+
+bool NBSfM::WriteMatchedFeatures(string matched_feature_folder_path, const Mat& matched_features) {
+  cout << endl << endl << "Write matched features.." << endl;
+
+  if (IsFolderExist(matched_feature_folder_path) && !IsFileWritable(matched_feature_folder_path)) {
+    cout << "Cannot write matched features." << endl;
+    return false;
+  }
+  WorkspaceWriter writer(matched_feature_folder_path);
+  if (!writer.Begin()) {
+    cout << "Cannot write matched features." << endl;
+    return false;
   }
 
   // Write features
   for (int i = 0; i < num_images_; i++) {
-    string feature_path = matched_feature_folder_path_ + "/" + image_names_[i] + ".csv";
+    string feature_path = writer.GetPath(image_names_[i] + ".csv");
     int index = i * 2;
     ofstream file(feature_path);
-    file << matched_features_.at<double>(index, 0);
+    file << matched_features.at<double>(index, 0);
     for (int j = 1; j < num_matched_features_; j++) {
-      file << "," << matched_features_.at<double>(index, j);
+      file << "," << matched_features.at<double>(index, j);
     }
     file << endl;
     index++;
-    file << matched_features_.at<double>(index, 0);
+    file << matched_features.at<double>(index, 0);
     for (int j = 1; j < num_matched_features_; j++) {
-      file << "," << matched_features_.at<double>(index, j);
+      file << "," << matched_features.at<double>(index, j);
     }
     file.close();
+    if (file.fail()) {
+      // Not committed, the old matched features stay
+      cout << "Cannot write matched features." << endl;
+      return false;
+    }
+  }
+  return writer.Commit();
+}
+
+bool NBSfM::LoadCamera() {
+  cout << endl << endl << "Load camera.." << endl;
+  FileStorage fs(camera_path_, FileStorage::READ);
+  if (!fs.isOpened()) {
+    return false;
+  }
+  fs["camera_matrix"] >> camera_matrix_;
+  fs["distortion_coefficients"] >> distortion_coefficients_;
+  fs.release();
+  if (camera_matrix_.rows != 3 || camera_matrix_.cols != 3) {
+    cerr << "  camera_matrix must be 3x3." << endl;
+    return false;
+  }
+  if (distortion_coefficients_.empty()) {
+    distortion_coefficients_ = Mat::zeros(1, 5, CV_64F);
+  }
+  return true;
+}
+
+bool NBSfM::BuildUndistortionMap() {
+  // Undistort every pixel once, row by row in parallel. Undistorted points are
+  // projected with the same camera matrix, so they stay in pixels.
+  undistortion_map_.create(image_height_ + 1, image_width_ + 1, CV_32FC2);
+  ParallelFor(0, undistortion_map_.rows, [&](int y) {
+    vector< Point2f > pixels(undistortion_map_.cols);
+    for (int x = 0; x < undistortion_map_.cols; x++) {
+      pixels[x] = Point2f(x, y);
+    }
+    vector< Point2f > undistorted_pixels;
+    undistortPoints(pixels, undistorted_pixels, camera_matrix_, distortion_coefficients_,
+                    noArray(), camera_matrix_);
+    copy(undistorted_pixels.begin(), undistorted_pixels.end(), undistortion_map_.ptr< Point2f >(y));
+  });
+  return true;
+}
+
+void NBSfM::UndistortPoints(const Point2f * points, Point2f * undistorted_points, int num_points) {
+  // Bilinear interpolation in undistortion_map_. Points outside of it are
+  // undistorted directly.
+  const float max_x = undistortion_map_.cols - 1;
+  const float max_y = undistortion_map_.rows - 1;
+  vector< int > outside_idx;
+  for (int k = 0; k < num_points; k++) {
+    float x = points[k].x;
+    float y = points[k].y;
+    if (!(x >= 0 && y >= 0 && x < max_x && y < max_y)) {
+      outside_idx.push_back(k);
+      continue;
+    }
+    int x0 = (int)x;
+    int y0 = (int)y;
+    float ax = x - x0;
+    float ay = y - y0;
+    const Point2f * row_0 = undistortion_map_.ptr< Point2f >(y0) + x0;
+    const Point2f * row_1 = undistortion_map_.ptr< Point2f >(y0 + 1) + x0;
+    float w_00 = (1 - ax) * (1 - ay);
+    float w_01 = ax * (1 - ay);
+    float w_10 = (1 - ax) * ay;
+    float w_11 = ax * ay;
+    undistorted_points[k].x = w_00 * row_0[0].x + w_01 * row_0[1].x + w_10 * row_1[0].x + w_11 * row_1[1].x;
+    undistorted_points[k].y = w_00 * row_0[0].y + w_01 * row_0[1].y + w_10 * row_1[0].y + w_11 * row_1[1].y;
+  }
+
+  if (!outside_idx.empty()) {
+    vector< Point2f > outside_points;
+    vector< Point2f > undistorted_outside_points;
+    for (auto k : outside_idx) {
+      outside_points.push_back(points[k]);
+    }
+    undistortPoints(outside_points, undistorted_outside_points, camera_matrix_,
+                    distortion_coefficients_, noArray(), camera_matrix_);
+    for (unsigned int o = 0; o < outside_idx.size(); o++) {
+      undistorted_points[outside_idx[o]] = undistorted_outside_points[o];
+    }
+  }
+}
+
+bool NBSfM::Undistortion() {
+  cout << endl << endl << "Undistortion.." << endl;
+
+  double tick = (double)getTickCount();
+  BuildUndistortionMap();
+  double map_time = ((double)getTickCount() - tick) / getTickFrequency();
+  cout << "  Build lookup table : " << map_time << " s" << endl;
+
+  // Undistort in batches of points in parallel
+  const int batch_size = 4096;
+  tick = (double)getTickCount();
+  int num_points = 0;
+  if (is_use_sparse_tracks_) {
+    num_points = track_points_.size();
+    undistorted_track_points_.resize(num_points);
+    int num_batches = (num_points + batch_size - 1) / batch_size;
+    ParallelFor(0, num_batches, [&](int b) {
+      int start = b * batch_size;
+      UndistortPoints(&track_points_[start], &undistorted_track_points_[start],
+                      min(batch_size, num_points - start));
+    });
+  } else {
+    num_points = num_images_ * num_matched_features_;
+    undistorted_matched_features_.create(2 * num_images_, num_matched_features_, CV_64F);
+    ParallelFor(0, num_images_, [&](int i) {
+      const double * row_x = matched_features_.ptr< double >(2 * i);
+      const double * row_y = matched_features_.ptr< double >(2 * i + 1);
+      double * undistorted_row_x = undistorted_matched_features_.ptr< double >(2 * i);
+      double * undistorted_row_y = undistorted_matched_features_.ptr< double >(2 * i + 1);
+      vector< Point2f > points(min(batch_size, num_matched_features_));
+      vector< Point2f > undistorted_points(points.size());
+      for (int start = 0; start < num_matched_features_; start += batch_size) {
+        int count = min(batch_size, num_matched_features_ - start);
+        for (int k = 0; k < count; k++) {
+          points[k] = Point2f(row_x[start + k], row_y[start + k]);
+        }
+        UndistortPoints(points.data(), undistorted_points.data(), count);
+        for (int k = 0; k < count; k++) {
+          undistorted_row_x[start + k] = undistorted_points[k].x;
+          undistorted_row_y[start + k] = undistorted_points[k].y;
+        }
+      }
+    });
   }
+  double undistortion_time = ((double)getTickCount() - tick) / getTickFrequency();
+  cout << "  Undistort " << num_points << " points : " << undistortion_time << " s" << endl;
   return true;
 }
 
@@ -809,21 +1831,1494 @@ bool NBSfM::WriteFeatureImage() {
   Mat img;
   images_.at(0).copyTo(img);
 
+  // The reference image is cropped to the region of interest
   for (int i = 0; i < num_features_; i++) {
     circle(img,
-           Point(features_.at< double >(0, i), features_.at< double >(1, i)),
+           Point(features_.at< double >(0, i) - roi_.x, features_.at< double >(1, i) - roi_.y),
            1, Scalar(0, 0, 255), -1);
   }
   for (int i = 0; i < num_matched_features_; i++) {
     circle(img,
-           Point(matched_features_.at< double >(0, i),
-                 matched_features_.at< double >(1, i)),
+           Point(matched_features_.at< double >(0, i) - roi_.x,
+                 matched_features_.at< double >(1, i) - roi_.y),
            1, Scalar(0, 255, 0), -1);
   }
+  Point2f roi_offset(roi_.x, roi_.y);
+  for (int k = 0; k < num_tracks_; k++) {
+    if (track_first_frames_[k] == 0) {
+      circle(img, track_points_[track_offsets_[k]] - roi_offset, 1, Scalar(0, 255, 0), -1);
+    }
+  }
   imwrite(workspace_path_ + "/FeatureImage.png", img);
   return true;
 }
 
+bool NBSfM::MakeChunks() {
+  cout << endl << endl << "Make chunks.." << endl;
+  chunk_names_.clear();
+  chunk_first_frames_.clear();
+  chunk_num_frames_.clear();
+
+  if (!IsFolderExist(chunk_folder_path_)) {
+    MakeDir(chunk_folder_path_);
+  }
+
+  int step = chunk_size_ - chunk_overlap_;
+  for (int first_frame = 0; ; first_frame += step) {
+    int num_frames = min(chunk_size_, num_images_ - first_frame);
+    std::ostringstream ss;
+    ss << "chunk_" << std::setw(4) << std::setfill('0') << chunk_names_.size();
+    string chunk_image_folder_path = chunk_folder_path_ + "/" + ss.str() + "/images";
+
+    // Clear images of a previous split
+    if (IsFolderExist(chunk_image_folder_path)) {
+      StringVec str_vec;
+      ReadDirectory(chunk_image_folder_path, str_vec);
+      for (auto name : str_vec) {
+        if (name != "." && name != "..") {
+          unlink((chunk_image_folder_path + "/" + name).c_str());
+        }
+      }
+    } else {
+      MakeDir(chunk_image_folder_path);
+    }
+
+    // Link images. The frame index keeps the image order in the chunk.
+    for (int i = first_frame; i < first_frame + num_frames; i++) {
+      char real_path[PATH_MAX];
+      if (realpath(image_paths_[i].c_str(), real_path) == NULL) {
+        cerr << "Cannot find image : " << image_paths_[i] << "." << endl;
+        return false;
+      }
+      std::ostringstream link_ss;
+      link_ss << chunk_image_folder_path << "/" << std::setw(6) << std::setfill('0') << i
+              << "_" << image_paths_[i].substr(image_paths_[i].find_last_of("/") + 1);
+      if (symlink(real_path, link_ss.str().c_str()) != 0) {
+        cerr << "Cannot link image : " << link_ss.str() << "." << endl;
+        return false;
+      }
+    }
+
+    chunk_names_.push_back(ss.str());
+    chunk_first_frames_.push_back(first_frame);
+    chunk_num_frames_.push_back(num_frames);
+    cout << "  " << ss.str() << " : images " << first_frame << " - " << first_frame + num_frames - 1 << endl;
+    if (first_frame + num_frames >= num_images_) {
+      break;
+    }
+  }
+
+  // Write chunk list
+  ofstream file(chunk_folder_path_ + "/chunks.csv");
+  for (unsigned int c = 0; c < chunk_names_.size(); c++) {
+    file << chunk_names_[c] << "," << chunk_first_frames_[c] << "," << chunk_num_frames_[c] << endl;
+  }
+  file.close();
+  if (file.fail()) {
+    cerr << "Cannot write chunk list." << endl;
+    return false;
+  }
+
+  if (num_chunk_processes_ == 0) {
+    cout << "  Run each chunk with :" << endl;
+    for (auto chunk_name : chunk_names_) {
+      vector< string > args = GetChunkArguments(chunk_folder_path_ + "/" + chunk_name);
+      cout << "   ";
+      for (auto arg : args) {
+        cout << " " << arg;
+      }
+      cout << endl;
+    }
+    cout << "  then merge with : " << program_path_ << " --workspace_path " << workspace_path_
+         << " --merge_chunks" << endl;
+  }
+  return true;
+}
+
+bool NBSfM::ReadChunks() {
+  chunk_names_.clear();
+  chunk_first_frames_.clear();
+  chunk_num_frames_.clear();
+
+  vector< vector < string > > data = ReadCSV(chunk_folder_path_ + "/chunks.csv");
+  for (auto row : data) {
+    if (row.size() != 3) {
+      return false;
+    }
+    chunk_names_.push_back(row[0]);
+    chunk_first_frames_.push_back(atoi(row[1].c_str()));
+    chunk_num_frames_.push_back(atoi(row[2].c_str()));
+  }
+  return !chunk_names_.empty();
+}
+
+vector< string > NBSfM::GetChunkArguments(string chunk_path) {
+  auto str = [](double value) {
+    std::ostringstream ss;
+    ss << std::setprecision(17) << value;
+    return ss.str();
+  };
+  vector< string > args = {
+    program_path_,
+    "--workspace_path", chunk_path,
+    "--redo_feature_detection",
+    "--sparse_tracks", str(min_track_length_),
+    "--max_num_features", str(max_num_features_),
+    "--quality_level", str(quality_level_),
+    "--min_distance", str(min_distance_),
+    "--block_size", str(block_size_),
+    "--window_size", str(window_size_),
+    "--max_level", str(max_level_),
+    "--bidirectional_threshold", str(bidirectional_threshold_),
+    "--tracker", tracker_type_,
+    "--backward_check", (is_use_selective_backward_) ? "selective" : "all",
+    str(forward_error_threshold_), str(audit_rate_)
+  };
+  if (is_use_roi_ && roi_mask_path_.empty()) {
+    args.insert(args.end(), {"--roi", str(roi_.x), str(roi_.y), str(roi_.width), str(roi_.height)});
+  } else if (is_use_roi_) {
+    args.insert(args.end(), {"--roi", roi_mask_path_});
+  }
+  if (is_use_pruning_) {
+    args.push_back("--prune_features");
+  }
+  return args;
+}
+
+bool NBSfM::RunChunks() {
+  cout << endl << endl << "Run chunks.." << endl;
+  if (chunk_names_.empty() && !ReadChunks()) {
+    cerr << "Cannot read chunks." << endl;
+    return false;
+  }
+
+  // Keep at most num_chunk_processes_ workers running
+  map< pid_t, int > workers;
+  unsigned int next_chunk = 0;
+  bool is_success = true;
+  while (next_chunk < chunk_names_.size() || !workers.empty()) {
+    if (next_chunk < chunk_names_.size() && (int)workers.size() < num_chunk_processes_) {
+      string chunk_path = chunk_folder_path_ + "/" + chunk_names_[next_chunk];
+      string log_path = chunk_path + "/log.txt";
+      vector< string > args = GetChunkArguments(chunk_path);
+      vector< char * > c_args;
+      for (auto& arg : args) {
+        c_args.push_back(&arg[0]);
+      }
+      c_args.push_back(NULL);
+
+      pid_t pid = fork();
+      if (pid == 0) {
+        int fd = open(log_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+          dup2(fd, STDOUT_FILENO);
+          dup2(fd, STDERR_FILENO);
+          close(fd);
+        }
+        execvp(c_args[0], c_args.data());
+        _exit(127);
+      } else if (pid < 0) {
+        cerr << "Cannot start a worker for " << chunk_names_[next_chunk] << "." << endl;
+        is_success = false;
+        break;
+      }
+      cout << "  Start " << chunk_names_[next_chunk] << endl;
+      workers[pid] = next_chunk;
+      next_chunk++;
+      continue;
+    }
+
+    int status;
+    pid_t pid = wait(&status);
+    if (pid < 0) {
+      break;
+    }
+    int chunk_idx = workers[pid];
+    workers.erase(pid);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+      cout << "  Finish " << chunk_names_[chunk_idx] << endl;
+    } else {
+      cerr << "  Fail " << chunk_names_[chunk_idx] << ", see "
+           << chunk_folder_path_ << "/" << chunk_names_[chunk_idx] << "/log.txt" << endl;
+      is_success = false;
+    }
+  }
+
+  // Do not leave workers behind
+  while (!workers.empty()) {
+    int status;
+    pid_t pid = wait(&status);
+    if (pid < 0) {
+      break;
+    }
+    workers.erase(pid);
+  }
+  return is_success;
+}
+
+bool NBSfM::MergeChunks() {
+  cout << endl << endl << "Merge chunks.." << endl;
+  if (chunk_names_.empty() && !ReadChunks()) {
+    cerr << "Cannot read chunks." << endl;
+    return false;
+  }
+
+  // Grid of link_threshold_ cells to find nearby tracks
+  const float cell_size = max(link_threshold_, 1.0);
+  auto cell_key = [](int cell_x, int cell_y) {
+    return ((long long)cell_x << 32) | (unsigned int)cell_y;
+  };
+
+  vector< int > merged_first_frames;
+  vector< vector< Point2f > > merged_points;
+  // Merged tracks which may still reach the next chunk
+  vector< int > open_tracks;
+  for (unsigned int c = 0; c < chunk_names_.size(); c++) {
+    int chunk_first_frame = chunk_first_frames_[c];
+    vector< int > first_frames;
+    vector< int > offsets;
+    vector< Point2f > points;
+    string track_path = chunk_folder_path_ + "/" + chunk_names_[c] + "/tracks/tracks.csv";
+    if (!ReadTracks(track_path, chunk_num_frames_[c], first_frames, offsets, points)) {
+      cerr << "Cannot read tracks of " << chunk_names_[c] << "." << endl;
+      return false;
+    }
+    int num_chunk_tracks = first_frames.size();
+
+    // Merged tracks observed on the reference image of this chunk
+    unordered_map< long long, vector< int > > grid;
+    unsigned int num_open = 0;
+    for (auto m : open_tracks) {
+      int merged_end = merged_first_frames[m] + merged_points[m].size();
+      if (merged_end <= chunk_first_frame) {
+        continue;
+      }
+      open_tracks[num_open++] = m;
+      const Point2f& p = merged_points[m][chunk_first_frame - merged_first_frames[m]];
+      grid[cell_key(floor(p.x / cell_size), floor(p.y / cell_size))].push_back(m);
+    }
+    open_tracks.resize(num_open);
+
+    // Candidate links by mean distance over the overlap images observed by both tracks
+    vector< pair< float, pair< int, int > > > links;
+    for (int t = 0; t < num_chunk_tracks; t++) {
+      if (first_frames[t] != 0) {
+        continue;
+      }
+      const Point2f& p = points[offsets[t]];
+      int cell_x = floor(p.x / cell_size);
+      int cell_y = floor(p.y / cell_size);
+      int track_end = chunk_first_frame + offsets[t + 1] - offsets[t];
+      for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+          auto it = grid.find(cell_key(cell_x + dx, cell_y + dy));
+          if (it == grid.end()) {
+            continue;
+          }
+          for (auto m : it->second) {
+            int merged_end = merged_first_frames[m] + merged_points[m].size();
+            int end = min(merged_end, track_end);
+            float sum = 0;
+            for (int i = chunk_first_frame; i < end; i++) {
+              sum += norm(merged_points[m][i - merged_first_frames[m]] -
+                          points[offsets[t] + i - chunk_first_frame]);
+            }
+            float distance = sum / (end - chunk_first_frame);
+            if (distance <= link_threshold_) {
+              links.push_back(make_pair(distance, make_pair(t, m)));
+            }
+          }
+        }
+      }
+    }
+
+    // Link one to one, closest first
+    sort(links.begin(), links.end());
+    vector< int > linked_track(num_chunk_tracks, -1);
+    vector< bool > is_merged_linked(merged_first_frames.size(), false);
+    int num_links = 0;
+    for (auto link : links) {
+      int t = link.second.first;
+      int m = link.second.second;
+      if (linked_track[t] < 0 && !is_merged_linked[m]) {
+        linked_track[t] = m;
+        is_merged_linked[m] = true;
+        num_links++;
+      }
+    }
+
+    // Extend linked tracks, and start new tracks from the others
+    for (int t = 0; t < num_chunk_tracks; t++) {
+      int first_frame = chunk_first_frame + first_frames[t];
+      int track_end = first_frame + offsets[t + 1] - offsets[t];
+      int m = linked_track[t];
+      if (m >= 0) {
+        int merged_end = merged_first_frames[m] + merged_points[m].size();
+        for (int i = merged_end; i < track_end; i++) {
+          merged_points[m].push_back(points[offsets[t] + i - first_frame]);
+        }
+      } else {
+        open_tracks.push_back(merged_first_frames.size());
+        merged_first_frames.push_back(first_frame);
+        merged_points.push_back(vector< Point2f >(points.begin() + offsets[t],
+                                                  points.begin() + offsets[t + 1]));
+      }
+    }
+    cout << "  " << chunk_names_[c] << " : link " << num_links << " / " << num_chunk_tracks << " tracks." << endl;
+  }
+
+  // Store merged tracks
+  num_images_ = chunk_first_frames_.back() + chunk_num_frames_.back();
+  num_tracks_ = merged_first_frames.size();
+  track_first_frames_ = merged_first_frames;
+  track_offsets_.assign(1, 0);
+  track_points_.clear();
+  for (int k = 0; k < num_tracks_; k++) {
+    track_points_.insert(track_points_.end(), merged_points[k].begin(), merged_points[k].end());
+    track_offsets_.push_back(track_points_.size());
+  }
+  cout << "  Get " << num_tracks_ << " tracks with " << track_points_.size() << " observations." << endl;
+  return true;
+}
+
+bool NBSfM::UndistortMergedTracks() {
+  // The lookup table covers the input images, whose size is read from the
+  // first image of the first chunk
+  string chunk_image_folder_path = chunk_folder_path_ + "/" + chunk_names_[0] + "/images";
+  StringVec str_vec;
+  ReadDirectory(chunk_image_folder_path, str_vec);
+  sort(str_vec.begin(), str_vec.end());
+  auto it = find_if(str_vec.begin(), str_vec.end(), [&](const string& name) { return CheckImage(name); });
+  Mat image = (it != str_vec.end()) ? imread(chunk_image_folder_path + "/" + *it, CV_LOAD_IMAGE_COLOR) : Mat();
+  if (!image.data) {
+    cerr << "Cannot read the first image of " << chunk_names_[0] << "." << endl;
+    return false;
+  }
+  image_width_ = image.cols;
+  image_height_ = image.rows;
+
+  // Merged chunks are sparse tracks
+  is_use_sparse_tracks_ = true;
+  if (!LoadCamera() || !Undistortion()) {
+    cerr << "Cannot undistort features." << endl;
+    return false;
+  }
+  if (!WriteTracks(undistorted_track_folder_path_, undistorted_track_points_)) {
+    cerr << "Cannot write undistorted features." << endl;
+    return false;
+  }
+  return true;
+}
+
+bool NBSfM::RenderSyntheticScene(int num_frames, vector< Mat >& homographies) {
+  // Render a textured tilted plane seen by a camera with small motion.
+  // The plane gives every reference pixel a known depth, so the motion of a
+  // reference pixel to frame i is given exactly by the homography H_i.
+  cout << endl << endl << "Render synthetic scene.." << endl;
+  const int width = 640;
+  const int height = 480;
+  const double focal = 500.0;
+  const double depth = 5.0;
+  const double tilt = 20.0 * CV_PI / 180.0;
+  const double baseline = 0.02;
+  const double rotation = 0.2 * CV_PI / 180.0;
+  RNG rng(0);
+
+  // Multi-scale noise texture
+  Mat texture = Mat::zeros(height, width, CV_32F);
+  for (int scale = 1; scale <= 16; scale *= 2) {
+    Mat noise(height / scale + 1, width / scale + 1, CV_32F);
+    rng.fill(noise, RNG::UNIFORM, Scalar(0), Scalar(1));
+    Mat noise_full;
+    resize(noise, noise_full, Size(width, height), 0, 0, INTER_CUBIC);
+    texture += noise_full * scale;
+  }
+  normalize(texture, texture, 0, 255, NORM_MINMAX);
+
+  Mat K = (Mat_< double >(3, 3) << focal, 0, width / 2.0,
+                                   0, focal, height / 2.0,
+                                   0, 0, 1);
+  Mat n = (Mat_< double >(3, 1) << 0, sin(tilt), cos(tilt));
+
+  num_images_ = num_frames;
+  image_width_ = width;
+  image_height_ = height;
+  images_.clear();
+  image_names_.clear();
+  homographies.clear();
+  for (int i = 0; i < num_frames; i++) {
+    double theta = 2.0 * CV_PI * i / num_frames;
+    Mat rvec = (Mat_< double >(3, 1) << rotation * sin(theta), rotation * cos(theta) - rotation, 0);
+    Mat t = (Mat_< double >(3, 1) << baseline * sin(theta), baseline * (cos(theta) - 1), 0);
+    Mat R;
+    Rodrigues(rvec, R);
+    Mat H = K * (R + t * n.t() / depth) * K.inv();
+    H = H / H.at< double >(2, 2);
+
+    Mat frame;
+    warpPerspective(texture, frame, H, Size(width, height), INTER_LINEAR, BORDER_CONSTANT);
+    Mat noise(height, width, CV_32F);
+    rng.fill(noise, RNG::NORMAL, Scalar(0), Scalar(2));
+    frame += noise;
+    Mat frame_8u;
+    frame.convertTo(frame_8u, CV_8U);
+    Mat frame_color;
+    cvtColor(frame_8u, frame_color, CV_GRAY2BGR);
+
+    std::ostringstream ss;
+    ss << std::setw(4) << std::setfill('0') << i;
+    images_.push_back(frame_color);
+    image_names_.push_back(ss.str());
+    homographies.push_back(H);
+  }
+  cout << "  Render " << num_frames << " frames." << endl;
+  return true;
+}
+
+double NBSfM::ComputeTrackingRMSE(const vector< Mat >& homographies) {
+  // Compare matched features with the ground truth given by the homographies
+  double sum = 0;
+  int count = 0;
+  for (int i = 1; i < num_images_; i++) {
+    const Mat& H = homographies.at(i);
+    int index = i * 2;
+    for (int j = 0; j < num_matched_features_; j++) {
+      double x = matched_features_.at< double >(0, j);
+      double y = matched_features_.at< double >(1, j);
+      double w = H.at< double >(2, 0) * x + H.at< double >(2, 1) * y + H.at< double >(2, 2);
+      double gt_x = (H.at< double >(0, 0) * x + H.at< double >(0, 1) * y + H.at< double >(0, 2)) / w;
+      double gt_y = (H.at< double >(1, 0) * x + H.at< double >(1, 1) * y + H.at< double >(1, 2)) / w;
+      double dx = matched_features_.at< double >(index,     j) - gt_x;
+      double dy = matched_features_.at< double >(index + 1, j) - gt_y;
+      sum += dx * dx + dy * dy;
+      count++;
+    }
+  }
+  if (count == 0) {
+    return numeric_limits< double >::quiet_NaN();
+  }
+  return sqrt(sum / count);
+}
+
+bool NBSfM::RunBenchmark() {
+  cout << endl << endl << "Benchmark.." << endl;
+  // Tracking error is measured on matched features of full images
+  is_use_sparse_tracks_ = false;
+  is_use_roi_ = false;
+  roi_ = Rect(0, 0, 0, 0);
+  roi_mask_.release();
+  vector< Mat > homographies;
+  if (!RenderSyntheticScene(benchmark_num_frames_, homographies)) {
+    return false;
+  }
+
+  // Parameter grid around the current parameters
+  vector< int > grid_max_num_features = {max_num_features_ / 10, max_num_features_};
+  vector< double > grid_quality_level = {quality_level_, 1e-3};
+  vector< double > grid_min_distance = {min_distance_, min_distance_ * 2};
+  vector< double > grid_bidirectional_threshold = {bidirectional_threshold_, bidirectional_threshold_ * 5};
+
+  // Keep the fixed precision so that tables can be diffed between releases
+  ostringstream table;
+  table << "max_num_features,quality_level,min_distance,block_size,tracker,window_size,max_level,"
+        << "bidirectional_threshold,backward_check,num_frames,num_features,num_matched_features,survival_rate,"
+        << "rmse,detection_time,matching_time,frames_per_second" << endl;
+  for (auto max_num_features : grid_max_num_features) {
+    for (auto quality_level : grid_quality_level) {
+      for (auto min_distance : grid_min_distance) {
+        for (auto bidirectional_threshold : grid_bidirectional_threshold) {
+          max_num_features_ = max(max_num_features, 1);
+          quality_level_ = quality_level;
+          min_distance_ = min_distance;
+          bidirectional_threshold_ = bidirectional_threshold;
+
+          double tick = (double)getTickCount();
+          FeatureDetection();
+          double detection_time = ((double)getTickCount() - tick) / getTickFrequency();
+
+          tick = (double)getTickCount();
+          bool is_matched = FeatureMatching();
+          double matching_time = ((double)getTickCount() - tick) / getTickFrequency();
+          if (!is_matched) {
+            num_matched_features_ = 0;
+          }
+
+          double survival_rate = (num_features_ > 0) ? (double)num_matched_features_ / num_features_ : 0;
+          double rmse = ComputeTrackingRMSE(homographies);
+          double frames_per_second = num_images_ / (detection_time + matching_time);
+
+          table << max_num_features_ << "," << quality_level_ << "," << min_distance_ << ","
+                << block_size_ << "," << tracker_type_ << "," << window_size_ << "," << max_level_ << ","
+                << bidirectional_threshold_ << "," << ((is_use_selective_backward_) ? "selective" : "all") << ","
+                << num_images_ << ","
+                << num_features_ << "," << num_matched_features_ << ","
+                << fixed << setprecision(4) << survival_rate << "," << rmse << ","
+                << detection_time << "," << matching_time << ","
+                << setprecision(2) << frames_per_second << endl;
+          table.unsetf(ios_base::floatfield);
+          table << setprecision(6);
+        }
+      }
+    }
+  }
+
+  string benchmark_path = workspace_path_ + "/benchmark.csv";
+  ofstream file(benchmark_path);
+  file << table.str();
+  file.close();
+  if (file.fail()) {
+    cerr << "  Cannot write " << benchmark_path << endl;
+    return false;
+  }
+  cout << endl << table.str();
+  cout << "  Write " << benchmark_path << endl;
+  return true;
+}
+
+bool NBSfM::ReadSweepGrid(const vector< string >& names, vector< vector< double > >& grid) {
+  // Each line is name,value_1,value_2,... Parameters which are not in the
+  // file keep their current value.
+  vector< vector < string > > data = ReadCSV(sweep_grid_path_);
+  for (auto& line : data) {
+    if (line.empty() || line[0].empty()) {
+      continue;
+    }
+    int p = find(names.begin(), names.end(), line[0]) - names.begin();
+    if (p == (int)names.size()) {
+      cerr << "  Unknown sweep parameter : " << line[0] << "." << endl;
+      return false;
+    }
+    if (line.size() < 2) {
+      cerr << "  Sweep parameter has no value : " << line[0] << "." << endl;
+      return false;
+    }
+    grid[p].clear();
+    for (unsigned int v = 1; v < line.size(); v++) {
+      grid[p].push_back(strtod(line[v].c_str(), NULL));
+    }
+  }
+
+  // Same limits as the command line parameters
+  for (unsigned int p = 0; p < names.size(); p++) {
+    for (auto value : grid[p]) {
+      bool is_valid = (names[p] == "quality_level" || names[p] == "bidirectional_threshold") ? value > 0 :
+                      (names[p] == "min_distance" || names[p] == "max_level") ? value >= 0 :
+                      (names[p] == "window_size") ? value >= 3 : value >= 1;
+      if (!is_valid) {
+        cerr << "  Invalid sweep value of " << names[p] << " : " << value << "." << endl;
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool NBSfM::RunSweep() {
+  cout << endl << endl << "Sweep.." << endl;
+  const vector< string > names = {"max_num_features", "quality_level", "min_distance", "block_size",
+                                  "window_size", "max_level", "bidirectional_threshold"};
+  vector< vector< double > > grid = {{(double)max_num_features_}, {quality_level_}, {min_distance_},
+                                     {(double)block_size_}, {(double)window_size_}, {(double)max_level_},
+                                     {bidirectional_threshold_}};
+  if (!ReadSweepGrid(names, grid)) {
+    return false;
+  }
+  int num_combinations = 1;
+  for (auto& values : grid) {
+    num_combinations *= values.size();
+  }
+  cout << "  " << num_combinations << " combinations." << endl;
+
+  // Images are decoded once and shared by all combinations
+  double tick = (double)getTickCount();
+  if (!LoadImages()) {
+    return false;
+  }
+  double decode_time = ((double)getTickCount() - tick) / getTickFrequency();
+
+  // Each combination is a copy with its own parameters and matching state.
+  // Copies share the image data.
+  vector< NBSfM > runs;
+  vector< string > run_names;
+  runs.reserve(num_combinations);
+  for (int c = 0; c < num_combinations; c++) {
+    vector< double > values(names.size());
+    int rest = c;
+    for (int p = names.size() - 1; p >= 0; p--) {
+      values[p] = grid[p][rest % grid[p].size()];
+      rest /= grid[p].size();
+    }
+    runs.push_back(*this);
+    NBSfM& run = runs.back();
+    run.max_num_features_ = values[0];
+    run.quality_level_ = values[1];
+    run.min_distance_ = values[2];
+    run.block_size_ = values[3];
+    run.window_size_ = values[4];
+    run.max_level_ = values[5];
+    run.bidirectional_threshold_ = values[6];
+
+    std::ostringstream ss;
+    ss << std::setw(4) << std::setfill('0') << c;
+    run_names.push_back(ss.str());
+  }
+
+  // Detect once per distinct detection parameters
+  vector< double > detection_times(num_combinations, 0);
+  for (int r = 0; r < num_combinations; r++) {
+    int s = 0;
+    while (s < r && !(runs[s].max_num_features_ == runs[r].max_num_features_ &&
+                      runs[s].quality_level_ == runs[r].quality_level_ &&
+                      runs[s].min_distance_ == runs[r].min_distance_ &&
+                      runs[s].block_size_ == runs[r].block_size_)) {
+      s++;
+    }
+    if (s == r) {
+      tick = (double)getTickCount();
+      runs[r].FeatureDetection();
+      detection_times[r] = ((double)getTickCount() - tick) / getTickFrequency();
+    } else {
+      runs[r].features_ = runs[s].features_.clone();
+      runs[r].num_features_ = runs[s].num_features_;
+      detection_times[r] = detection_times[s];
+    }
+  }
+
+  // Pyramids are built once per image and distinct window_size and max_level
+  vector< pair< int, int > > pyramid_keys;
+  vector< int > run_keys(num_combinations);
+  for (int r = 0; r < num_combinations; r++) {
+    pair< int, int > key(runs[r].window_size_, runs[r].max_level_);
+    run_keys[r] = find(pyramid_keys.begin(), pyramid_keys.end(), key) - pyramid_keys.begin();
+    if (run_keys[r] == (int)pyramid_keys.size()) {
+      pyramid_keys.push_back(key);
+    }
+  }
+  int num_keys = pyramid_keys.size();
+  vector< vector< Mat > > reference_pyramids(num_keys);
+  vector< vector< Mat > > pyramids(num_keys);
+  Mat gray;
+
+  cout << endl << endl << "Feature matching.." << endl;
+  cout << "  " << num_keys << " distinct pyramids per image." << endl;
+  tick = (double)getTickCount();
+  cvtColor(images_.at(0), reference_gray_, CV_RGB2GRAY);
+  ParallelFor(0, num_keys, [&](int k) {
+    Size window_size(pyramid_keys[k].first, pyramid_keys[k].first);
+    buildOpticalFlowPyramid(reference_gray_, reference_pyramids[k], window_size, pyramid_keys[k].second);
+  });
+  double pyramid_time = ((double)getTickCount() - tick) / getTickFrequency();
+  for (int r = 0; r < num_combinations; r++) {
+    NBSfM& run = runs[r];
+    run.reference_gray_ = reference_gray_;
+    run.reference_pyramid_ = reference_pyramids[run_keys[r]];
+    run.tracking_scratch_.assign(1, TrackingScratch());
+    run.tracking_scratch_[0].tracker = run.CreateTracker();
+    run.InitMatching();
+  }
+
+  // Track image by image. All combinations track an image concurrently on
+  // the pyramids of that image, so only one image's pyramids are alive.
+  for (int i = 0; i < num_images_; i++) {
+    if (i > 0) {
+      tick = (double)getTickCount();
+      cvtColor(images_.at(i), gray, CV_RGB2GRAY);
+      ParallelFor(0, num_keys, [&](int k) {
+        Size window_size(pyramid_keys[k].first, pyramid_keys[k].first);
+        buildOpticalFlowPyramid(gray, pyramids[k], window_size, pyramid_keys[k].second);
+      });
+      pyramid_time += ((double)getTickCount() - tick) / getTickFrequency();
+    }
+    const vector< vector< Mat > >& image_pyramids = (i == 0) ? reference_pyramids : pyramids;
+    ParallelFor(0, num_combinations, [&](int r) {
+      NBSfM& run = runs[r];
+      run.TrackPyramid(i, image_pyramids[run_keys[r]], run.live_features_, run.tracking_scratch_[0]);
+      run.CollectMatches(i, run.tracking_scratch_[0]);
+      if (run.is_use_pruning_) {
+        run.PruneFeatures(i);
+      }
+    });
+    cout << "  " << i + 1 << " / " << num_images_ << endl;
+  }
+
+  // Write each combination to workspace_path/sweep/<combination>
+  string sweep_folder_path = workspace_path_ + "/sweep";
+  if (!MakeDir(sweep_folder_path)) {
+    return false;
+  }
+  std::ostringstream header;
+  header << "combination,max_num_features,quality_level,min_distance,block_size,window_size,max_level,"
+         << "bidirectional_threshold,num_features," << ((is_use_sparse_tracks_) ? "num_tracks" : "num_matched_features")
+         << ",detection_time,forward_time,backward_time,shared_decode_time,shared_pyramid_time" << endl;
+  std::ostringstream table;
+  table << header.str();
+  for (int r = 0; r < num_combinations; r++) {
+    NBSfM& run = runs[r];
+    cout << endl << endl << "Combination " << run_names[r] << ".." << endl;
+    bool is_matched = run.FinishMatching();
+    int num_matched = (!is_matched) ? 0 :
+                      (is_use_sparse_tracks_) ? run.num_tracks_ : run.num_matched_features_;
+
+    string run_path = sweep_folder_path + "/" + run_names[r];
+    if (!MakeDir(run_path)) {
+      return false;
+    }
+    WorkspaceWriter::RemoveStale(run_path);
+    run.feature_folder_path_ = run_path + "/features";
+    run.matched_feature_folder_path_ = run_path + "/matched_features";
+    run.track_folder_path_ = run_path + "/tracks";
+    bool is_written = run.WriteFeatures();
+    if (is_written && is_matched) {
+      is_written = (is_use_sparse_tracks_) ? run.WriteTracks(run.track_folder_path_, run.track_points_) :
+                   run.WriteMatchedFeatures(run.matched_feature_folder_path_, run.matched_features_);
+    }
+    if (!is_written) {
+      return false;
+    }
+
+    std::ostringstream row;
+    row << run_names[r] << "," << run.max_num_features_ << "," << run.quality_level_ << ","
+        << run.min_distance_ << "," << run.block_size_ << "," << run.window_size_ << ","
+        << run.max_level_ << "," << run.bidirectional_threshold_ << ","
+        << run.num_features_ << "," << num_matched << ","
+        << fixed << setprecision(4) << detection_times[r] << ","
+        << run.tracking_scratch_[0].forward_time << "," << run.tracking_scratch_[0].backward_time << ","
+        << decode_time << "," << pyramid_time << endl;
+    ofstream file(run_path + "/timings.csv");
+    file << header.str() << row.str();
+    file.close();
+    if (file.fail()) {
+      cerr << "  Cannot write " << run_path << "/timings.csv" << endl;
+      return false;
+    }
+    table << row.str();
+  }
+
+  string sweep_path = sweep_folder_path + "/sweep.csv";
+  ofstream file(sweep_path);
+  file << table.str();
+  file.close();
+  if (file.fail()) {
+    cerr << "  Cannot write " << sweep_path << endl;
+    return false;
+  }
+  cout << endl << table.str();
+  cout << "  Decode " << decode_time << " s and build pyramids " << pyramid_time
+       << " s once for " << num_combinations << " combinations." << endl;
+  cout << "  Write " << sweep_path << endl;
+  return true;
+}
+
+// Set by SIGINT to finish a stream and report its latency
+static volatile sig_atomic_t is_stream_interrupted = 0;
+
+static void InterruptStream(int) {
+  // The handler is reset by the first SIGINT, so a second one kills a
+  // process which is blocked waiting for a frame
+  is_stream_interrupted = 1;
+  const char message[] = "\nStop after the current frame, interrupt again to quit.\n";
+  ssize_t num_written = write(STDERR_FILENO, message, sizeof(message) - 1);
+  (void)num_written;
+}
+
+void NBSfM::ScanStreamFolder(const string& last_image_name, double tick) {
+  // Queue the images of the folder after last_image_name in name order.
+  // Images which are already queued keep their arrival.
+  map< string, double > arrival_ticks(stream_pending_images_.begin(), stream_pending_images_.end());
+  StringVec names;
+  ReadDirectory(stream_source_, names);
+  sort(names.begin(), names.end());
+  stream_pending_images_.clear();
+  for (auto& name : names) {
+    if (name > last_image_name && CheckImage(name)) {
+      auto it = arrival_ticks.find(name);
+      stream_pending_images_.push_back(make_pair(name, (it != arrival_ticks.end()) ? it->second : tick));
+    }
+  }
+}
+
+bool NBSfM::ReadStreamEvents(int timeout, const string& last_image_name) {
+  // Queue the images written or moved into the folder, with the time their
+  // notifications are read. Waits up to timeout ms for the first one.
+  // Returns false if the folder is gone.
+  while (true) {
+    struct pollfd watch_poll;
+    watch_poll.fd = stream_watch_fd_;
+    watch_poll.events = POLLIN;
+    watch_poll.revents = 0;
+    int num_ready = poll(&watch_poll, 1, timeout);
+    if (num_ready < 0 && errno != EINTR) {
+      return false;
+    }
+    if (num_ready <= 0) {
+      return true;
+    }
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length = read(stream_watch_fd_, buffer, sizeof(buffer));
+    double tick = (double)getTickCount();
+    for (ssize_t offset = 0; offset < length; ) {
+      const struct inotify_event * event = (const struct inotify_event *)(buffer + offset);
+      if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+        cerr << "  Stream folder is gone." << endl;
+        return false;
+      }
+      if (event->mask & IN_Q_OVERFLOW) {
+        // Notifications were dropped
+        cerr << "  Missed notifications, scan the stream folder." << endl;
+        ScanStreamFolder(last_image_name, tick);
+      } else if (event->len > 0 && CheckImage(event->name)) {
+        stream_pending_images_.push_back(make_pair(string(event->name), tick));
+      }
+      offset += sizeof(struct inotify_event) + event->len;
+    }
+    timeout = 0;
+  }
+}
+
+bool NBSfM::ReadStreamFrame(VideoCapture& capture, string& last_image_name, Mat& frame, double& arrival_tick) {
+  if (capture.isOpened()) {
+    // Blocks until the next frame, which is decoded once it arrived. Frames
+    // which the driver buffered while the last frame was tracked return at
+    // once, so their latency misses the time spent in the buffer.
+    if (!capture.grab()) {
+      return false;
+    }
+    arrival_tick = (double)getTickCount();
+    return capture.retrieve(frame) && !frame.empty();
+  }
+
+  // Take the next image which was written or moved into the folder. Names
+  // seen by both a scan and a notification are skipped, so images have to
+  // appear in name order. Notifications which arrived while the last frame
+  // was tracked are read first, so that they keep their arrival.
+  if (!ReadStreamEvents(0, last_image_name)) {
+    return false;
+  }
+  double idle_tick = (double)getTickCount();
+  while (!is_stream_interrupted) {
+    while (!stream_pending_images_.empty()) {
+      string name = stream_pending_images_.front().first;
+      double tick = stream_pending_images_.front().second;
+      stream_pending_images_.pop_front();
+      if (name <= last_image_name) {
+        continue;
+      }
+      arrival_tick = tick;
+      last_image_name = name;
+      frame = imread(stream_source_ + "/" + name, CV_LOAD_IMAGE_COLOR);
+      if (frame.data) {
+        return true;
+      }
+      cerr << "  Cannot read an image : " << name << ", skip it." << endl;
+      idle_tick = (double)getTickCount();
+    }
+
+    // Wait for notifications, whose cost doesn't depend on the folder size
+    double idle_time = ((double)getTickCount() - idle_tick) / getTickFrequency();
+    if (idle_time >= stream_idle_timeout_) {
+      return false;
+    }
+    if (!ReadStreamEvents((int)ceil((stream_idle_timeout_ - idle_time) * 1000), last_image_name)) {
+      return false;
+    }
+  }
+  return false;
+}
+
+bool NBSfM::RunStream() {
+  cout << endl << endl << "Stream.." << endl;
+  // Frames are tracked as one image of workspace_path/stream each
+  is_use_sparse_tracks_ = false;
+
+  // Source is a camera index, a video file or named pipe, or an image folder
+  VideoCapture capture;
+  if (!IsFolderExist(stream_source_)) {
+    char * end = NULL;
+    long camera_index = strtol(stream_source_.c_str(), &end, 10);
+    if (*end == '\0') {
+      capture.open((int)camera_index);
+    } else {
+      capture.open(stream_source_);
+    }
+    if (!capture.isOpened()) {
+      cerr << "  Cannot open stream : " << stream_source_ << "." << endl;
+      return false;
+    }
+  }
+  string stream_folder_path = workspace_path_ + "/stream";
+  WorkspaceWriter::RemoveDir(stream_folder_path);
+  if (!MakeDir(stream_folder_path)) {
+    return false;
+  }
+
+  // Latency from the arrival of a frame to its features being written, in
+  // bins of 0.1 ms up to 1 s and one bin above. Memory doesn't depend on the
+  // number of frames.
+  const int num_latency_bins = 10000;
+  vector< int > latency_histogram(num_latency_bins + 1, 0);
+  double max_latency = 0;
+
+  vector< double > frame_x;
+  vector< double > frame_y;
+  const double nan = numeric_limits< double >::quiet_NaN();
+  string last_image_name;
+  Mat frame;
+
+  // Watch the folder before scanning it once, so no image is missed
+  if (!capture.isOpened()) {
+    stream_watch_fd_ = inotify_init1(IN_CLOEXEC);
+    if (stream_watch_fd_ < 0 ||
+        inotify_add_watch(stream_watch_fd_, stream_source_.c_str(),
+                          IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+      cerr << "  Cannot watch stream folder : " << stream_source_ << "." << endl;
+      if (stream_watch_fd_ >= 0) {
+        close(stream_watch_fd_);
+        stream_watch_fd_ = -1;
+      }
+      return false;
+    }
+    stream_pending_images_.clear();
+    ScanStreamFolder(last_image_name, (double)getTickCount());
+  }
+  double arrival_tick = 0;
+  int num_frames = 0;
+  bool is_written = true;
+  // Without SA_RESTART, so that blocking reads fail with EINTR
+  struct sigaction interrupt_action;
+  struct sigaction old_interrupt_action;
+  memset(&interrupt_action, 0, sizeof(interrupt_action));
+  interrupt_action.sa_handler = InterruptStream;
+  interrupt_action.sa_flags = SA_RESETHAND;
+  sigemptyset(&interrupt_action.sa_mask);
+  is_stream_interrupted = 0;
+  sigaction(SIGINT, &interrupt_action, &old_interrupt_action);
+  while (!is_stream_interrupted && ReadStreamFrame(capture, last_image_name, frame, arrival_tick)) {
+    int i = num_frames;
+    if (i == 0) {
+      // Reference frame
+      image_width_ = frame.cols;
+      image_height_ = frame.rows;
+      if (!SetROI(frame)) {
+        break;
+      }
+      images_.assign(1, (is_use_roi_) ? frame(roi_).clone() : frame.clone());
+      num_images_ = 1;
+      FeatureDetection();
+      if (num_features_ == 0) {
+        cerr << "  No features on the first frame." << endl;
+        break;
+      }
+      BuildReferencePyramid();
+      InitMatching();
+      tracking_scratch_.assign(1, TrackingScratch());
+      tracking_scratch_[0].tracker = CreateTracker();
+      cout << endl << endl << "Feature matching.." << endl;
+    } else if (frame.cols != image_width_ || frame.rows != image_height_) {
+      cerr << "  A frame doesn't have the same size, skip it." << endl;
+      continue;
+    }
+
+    // Track the frame, which is not kept
+    TrackingScratch& scratch = tracking_scratch_[0];
+    Mat image = (is_use_roi_) ? frame(roi_) : frame;
+    TrackImage(image, i, live_features_, scratch);
+
+    // Features which are not matched on the frame are nan
+    frame_x.assign(num_features_, nan);
+    frame_y.assign(num_features_, nan);
+    int num_live = live_idx_.size();
+    int num_frame_matches = 0;
+    for (int k = 0; k < num_live; k++) {
+      int j = live_idx_[k];
+      if (i == 0 || scratch.mask[k] != 0) {
+        frame_x[j] = scratch.features_forward[k].x + roi_.x;
+        frame_y[j] = scratch.features_forward[k].y + roi_.y;
+        num_frame_matches++;
+      }
+      if (i > 0 && scratch.mask[k] != 0) {
+        match_counts_[j]++;
+      }
+    }
+    if (is_use_pruning_) {
+      PruneFeatures(i);
+    }
+
+    // Write to a temporary file and rename, so that readers see whole files
+    std::ostringstream ss;
+    ss << stream_folder_path << "/" << std::setw(6) << std::setfill('0') << i << ".csv";
+    string frame_path = ss.str();
+    ofstream file(frame_path + ".tmp");
+    file << frame_x[0];
+    for (int j = 1; j < num_features_; j++) {
+      file << "," << frame_x[j];
+    }
+    file << endl;
+    file << frame_y[0];
+    for (int j = 1; j < num_features_; j++) {
+      file << "," << frame_y[j];
+    }
+    file.close();
+    if (file.fail() || rename((frame_path + ".tmp").c_str(), frame_path.c_str()) != 0) {
+      cerr << "  Cannot write " << frame_path << ", stop the stream." << endl;
+      unlink((frame_path + ".tmp").c_str());
+      is_written = false;
+      break;
+    }
+
+    double latency = ((double)getTickCount() - arrival_tick) / getTickFrequency() * 1000.0;
+    latency_histogram[min((int)(latency * 10), num_latency_bins)]++;
+    max_latency = max(max_latency, latency);
+    num_frames++;
+    if (num_frames % 100 == 0) {
+      cout << "  Frame " << i << " : " << num_frame_matches << " / " << num_features_
+           << " features, latency " << latency << " ms" << endl;
+    }
+  }
+  sigaction(SIGINT, &old_interrupt_action, NULL);
+  if (stream_watch_fd_ >= 0) {
+    close(stream_watch_fd_);
+    stream_watch_fd_ = -1;
+  }
+  stream_pending_images_.clear();
+
+  if (num_frames == 0) {
+    cerr << "  No frames." << endl;
+    return false;
+  }
+
+  // Percentiles of the histogram are upper bounds of their bins
+  vector< double > percentiles = {50, 90, 99};
+  vector< double > latencies;
+  for (auto percentile : percentiles) {
+    int rank = ceil(percentile / 100.0 * num_frames);
+    int count = 0;
+    int bin = 0;
+    while (bin < num_latency_bins && count + latency_histogram[bin] < rank) {
+      count += latency_histogram[bin];
+      bin++;
+    }
+    latencies.push_back((bin < num_latency_bins) ? min((bin + 1) / 10.0, max_latency) : max_latency);
+  }
+  cout << "  Track " << num_frames << " frames, " << live_idx_.size() << " / " << num_features_
+       << " features still tracked." << endl;
+  cout << "  Latency : p50 " << latencies[0] << " ms, p90 " << latencies[1] << " ms, p99 "
+       << latencies[2] << " ms, max " << max_latency << " ms" << endl;
+
+  string latency_path = stream_folder_path + "/latency.csv";
+  ofstream file(latency_path);
+  file << "num_frames,p50,p90,p99,max" << endl;
+  file << num_frames << "," << fixed << setprecision(2) << latencies[0] << "," << latencies[1] << ","
+       << latencies[2] << "," << max_latency << endl;
+  file.close();
+  if (file.fail()) {
+    cerr << "  Cannot write " << latency_path << endl;
+    return false;
+  }
+  cout << "  Write " << latency_path << endl;
+  return is_written;
+}
+
+KLTTracker::KLTTracker(const vector< Mat >& reference_pyramid, Size window_size, int max_level) :
+    reference_pyramid_(reference_pyramid),
+    image_pyramid_(&pyramid_),
+    window_size_(window_size),
+    max_level_(max_level) {
+}
+
+void KLTTracker::Forward(const Mat& gray, const vector< Point2f >& points, vector< Point2f >& forward_points,
+                         vector< unsigned char >& status, vector< float >& error) {
+  buildOpticalFlowPyramid(gray, pyramid_, window_size_, max_level_);
+  ForwardPyramid(pyramid_, points, forward_points, status, error);
+}
+
+void KLTTracker::ForwardPyramid(const vector< Mat >& pyramid, const vector< Point2f >& points,
+                                vector< Point2f >& forward_points, vector< unsigned char >& status,
+                                vector< float >& error) {
+  image_pyramid_ = &pyramid;
+  calcOpticalFlowPyrLK(reference_pyramid_, pyramid, points, forward_points,
+                       status, error, window_size_, max_level_);
+}
+
+void KLTTracker::Backward(const vector< Point2f >& points, vector< Point2f >& backward_points,
+                          vector< unsigned char >& status, vector< float >& error) {
+  calcOpticalFlowPyrLK(*image_pyramid_, reference_pyramid_, points, backward_points,
+                       status, error, window_size_, max_level_);
+}
+
+BufferStorage KLTTracker::GetStorage() const {
+  BufferStorage storage = { (uintptr_t)pyramid_.data(), pyramid_.capacity() };
+  for (auto& level : pyramid_) {
+    storage.data ^= (uintptr_t)level.data;
+    storage.size += level.total() * level.elemSize();
+  }
+  return storage;
+}
+
+DenseFlowTracker::DenseFlowTracker(const Mat& reference_gray, Size window_size, int max_level) :
+    reference_gray_(reference_gray),
+    is_backward_flow_ready_(false),
+    window_size_(window_size),
+    max_level_(max_level) {
+#ifdef NBSFM_HAVE_DIS_OPTICAL_FLOW
+  dis_ = DISOpticalFlow::create(DISOpticalFlow::PRESET_MEDIUM);
+#endif
+}
+
+string DenseFlowTracker::GetName() const {
+#ifdef NBSFM_HAVE_DIS_OPTICAL_FLOW
+  return "dense (DIS)";
+#else
+  return "dense (Farneback)";
+#endif
+}
+
+void DenseFlowTracker::ComputeFlow(const Mat& from, const Mat& to, Mat& flow) {
+#ifdef NBSFM_HAVE_DIS_OPTICAL_FLOW
+  dis_->calc(from, to, flow);
+#else
+  calcOpticalFlowFarneback(from, to, flow, 0.5, max_level_ + 1, window_size_.width, 3, 5, 1.1, 0);
+#endif
+}
+
+bool DenseFlowTracker::Sample(const Mat& image, Point2f p, float& value) const {
+  // Bilinear interpolation of an 8-bit image
+  if (!(p.x >= 0 && p.y >= 0 && p.x < image.cols - 1 && p.y < image.rows - 1)) {
+    return false;
+  }
+  int x0 = (int)p.x;
+  int y0 = (int)p.y;
+  float ax = p.x - x0;
+  float ay = p.y - y0;
+  const unsigned char * row_0 = image.ptr< unsigned char >(y0) + x0;
+  const unsigned char * row_1 = image.ptr< unsigned char >(y0 + 1) + x0;
+  value = (1 - ay) * ((1 - ax) * row_0[0] + ax * row_0[1]) +
+          ay * ((1 - ax) * row_1[0] + ax * row_1[1]);
+  return true;
+}
+
+bool DenseFlowTracker::SampleFlow(const Mat& flow, Point2f p, Point2f& q) const {
+  // Bilinear interpolation of the flow, q = p + flow(p)
+  if (!(p.x >= 0 && p.y >= 0 && p.x < flow.cols - 1 && p.y < flow.rows - 1)) {
+    return false;
+  }
+  int x0 = (int)p.x;
+  int y0 = (int)p.y;
+  float ax = p.x - x0;
+  float ay = p.y - y0;
+  const Point2f * row_0 = flow.ptr< Point2f >(y0) + x0;
+  const Point2f * row_1 = flow.ptr< Point2f >(y0 + 1) + x0;
+  q.x = p.x + (1 - ay) * ((1 - ax) * row_0[0].x + ax * row_0[1].x) +
+              ay * ((1 - ax) * row_1[0].x + ax * row_1[1].x);
+  q.y = p.y + (1 - ay) * ((1 - ax) * row_0[0].y + ax * row_0[1].y) +
+              ay * ((1 - ax) * row_1[0].y + ax * row_1[1].y);
+  return true;
+}
+
+void DenseFlowTracker::Forward(const Mat& gray, const vector< Point2f >& points, vector< Point2f >& forward_points,
+                               vector< unsigned char >& status, vector< float >& error) {
+  gray_ = gray;
+  is_backward_flow_ready_ = false;
+  ComputeFlow(reference_gray_, gray_, forward_flow_);
+
+  // Error is the absolute intensity difference, as the error of LK
+  forward_points.resize(points.size());
+  status.resize(points.size());
+  error.resize(points.size());
+  for (unsigned int j = 0; j < points.size(); j++) {
+    float value_0 = 0;
+    float value_1 = 0;
+    status[j] = (SampleFlow(forward_flow_, points[j], forward_points[j]) &&
+                 Sample(reference_gray_, points[j], value_0) &&
+                 Sample(gray_, forward_points[j], value_1)) ? 1 : 0;
+    if (status[j] == 0) {
+      forward_points[j] = points[j];
+    }
+    error[j] = fabs(value_1 - value_0);
+  }
+}
+
+void DenseFlowTracker::Backward(const vector< Point2f >& points, vector< Point2f >& backward_points,
+                                vector< unsigned char >& status, vector< float >& error) {
+  // The backward flow is computed only when backward points are needed
+  if (!is_backward_flow_ready_) {
+    ComputeFlow(gray_, reference_gray_, backward_flow_);
+    is_backward_flow_ready_ = true;
+  }
+
+  backward_points.resize(points.size());
+  status.resize(points.size());
+  error.resize(points.size());
+  for (unsigned int j = 0; j < points.size(); j++) {
+    float value_0 = 0;
+    float value_1 = 0;
+    status[j] = (SampleFlow(backward_flow_, points[j], backward_points[j]) &&
+                 Sample(gray_, points[j], value_0) &&
+                 Sample(reference_gray_, backward_points[j], value_1)) ? 1 : 0;
+    if (status[j] == 0) {
+      backward_points[j] = points[j];
+    }
+    error[j] = fabs(value_1 - value_0);
+  }
+}
+
+constexpr const char * WorkspaceWriter::kMarkerName;
+
+BufferStorage DenseFlowTracker::GetStorage() const {
+  BufferStorage storage = { (uintptr_t)forward_flow_.data ^ (uintptr_t)backward_flow_.data,
+                                       forward_flow_.total() + backward_flow_.total() };
+  return storage;
+}
+
+WorkspaceWriter::WorkspaceWriter(string folder_path) :
+    folder_path_(folder_path),
+    is_begun_(false) {
+  // Strip trailing slashes so that the temporary folder is a sibling
+  while (folder_path_.size() > 1 && folder_path_[folder_path_.size() - 1] == '/') {
+    folder_path_.erase(folder_path_.size() - 1);
+  }
+  std::ostringstream ss;
+  ss << folder_path_ << ".tmp." << getpid();
+  temporary_path_ = ss.str();
+}
+
+WorkspaceWriter::~WorkspaceWriter() {
+  // Not committed
+  if (is_begun_) {
+    RemoveDir(temporary_path_);
+  }
+}
+
+bool WorkspaceWriter::Begin() {
+  if (!IsReplaceable(folder_path_)) {
+    return false;
+  }
+  RemoveDir(temporary_path_);
+  if (!MakeDir(temporary_path_) || !WriteMarker(temporary_path_)) {
+    return false;
+  }
+  file_names_.clear();
+  is_begun_ = true;
+  return true;
+}
+
+string WorkspaceWriter::GetPath(string file_name) {
+  file_names_.push_back(file_name);
+  return temporary_path_ + "/" + file_name;
+}
+
+bool WorkspaceWriter::Commit() {
+  if (!is_begun_) {
+    return false;
+  }
+
+  // Flush all files once. A failed flush keeps the old folder.
+  for (auto file_name : file_names_) {
+    int fd = open((temporary_path_ + "/" + file_name).c_str(), O_RDONLY);
+    bool is_flushed = fd >= 0 && fsync(fd) == 0;
+    if (fd >= 0) {
+      close(fd);
+    }
+    if (!is_flushed) {
+      cerr << "Cannot write " << temporary_path_ << "/" << file_name << endl;
+      return false;
+    }
+  }
+  int dir_fd = open(temporary_path_.c_str(), O_RDONLY);
+  if (dir_fd >= 0) {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+
+  // Swap in the new folder, which is not temporary anymore
+  if (!IsReplaceable(folder_path_)) {
+    return false;
+  }
+  unlink((temporary_path_ + "/" + kMarkerName).c_str());
+  struct stat info;
+  if (stat(folder_path_.c_str(), &info) != 0) {
+    if (rename(temporary_path_.c_str(), folder_path_.c_str()) != 0) {
+      cerr << "Cannot rename " << temporary_path_ << " to " << folder_path_ << endl;
+      return false;
+    }
+  } else {
+#if defined(SYS_renameat2)
+    // Atomic exchange, the old folder ends up in the temporary path
+    const unsigned int rename_exchange = 1 << 1;
+    bool is_exchanged = syscall(SYS_renameat2, AT_FDCWD, temporary_path_.c_str(),
+                                AT_FDCWD, folder_path_.c_str(), rename_exchange) == 0;
+#else
+    bool is_exchanged = false;
+#endif
+    if (!is_exchanged) {
+      // Two renames, a failure in between leaves the old folder aside
+      std::ostringstream ss;
+      ss << folder_path_ << ".old." << getpid();
+      string old_path = ss.str();
+      RemoveDir(old_path);
+      if (rename(folder_path_.c_str(), old_path.c_str()) != 0) {
+        cerr << "Cannot rename " << temporary_path_ << " to " << folder_path_ << endl;
+        return false;
+      }
+      if (rename(temporary_path_.c_str(), folder_path_.c_str()) != 0) {
+        cerr << "Cannot rename " << temporary_path_ << " to " << folder_path_ << endl;
+        rename(old_path.c_str(), folder_path_.c_str());
+        return false;
+      }
+      // The old folder is temporary from now on
+      WriteMarker(old_path);
+      rename(old_path.c_str(), temporary_path_.c_str());
+    }
+    RemoveDir(temporary_path_);
+  }
+  is_begun_ = false;
+
+  // Flush the rename
+  size_t last_slash = folder_path_.find_last_of("/");
+  string parent_path = (last_slash == string::npos) ? "." :
+                       (last_slash == 0) ? "/" : folder_path_.substr(0, last_slash);
+  dir_fd = open(parent_path.c_str(), O_RDONLY);
+  if (dir_fd >= 0) {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+  return true;
+}
+
+bool WorkspaceWriter::MakeDir(string path) {
+  // Same as mkdir -p
+  for (size_t pos = path.find('/', 1); ; pos = path.find('/', pos + 1)) {
+    string sub_path = path.substr(0, pos);
+    if (!sub_path.empty() && mkdir(sub_path.c_str(), 0755) != 0 && errno != EEXIST) {
+      return false;
+    }
+    if (pos == string::npos) {
+      break;
+    }
+  }
+  return true;
+}
+
+bool WorkspaceWriter::RemoveDir(string path) {
+  // Same as rm -r, without following links
+  struct stat info;
+  if (lstat(path.c_str(), &info) != 0) {
+    return true;
+  }
+  if (!S_ISDIR(info.st_mode)) {
+    return unlink(path.c_str()) == 0;
+  }
+  DIR* dirp = opendir(path.c_str());
+  if (dirp == NULL) {
+    return false;
+  }
+  struct dirent * dp;
+  while ((dp = readdir(dirp)) != NULL) {
+    string name(dp->d_name);
+    if (name != "." && name != "..") {
+      RemoveDir(path + "/" + name);
+    }
+  }
+  closedir(dirp);
+  return rmdir(path.c_str()) == 0;
+}
+
+bool WorkspaceWriter::IsReplaceable(string path) {
+  // The old folder is removed after the swap, so it may only hold .csv files
+  // written by a stage. Other files would be lost with it.
+  struct stat info;
+  if (lstat(path.c_str(), &info) != 0) {
+    return true;
+  }
+  DIR* dirp = (S_ISDIR(info.st_mode)) ? opendir(path.c_str()) : NULL;
+  if (dirp == NULL) {
+    cerr << path << " is not a folder which can be replaced." << endl;
+    return false;
+  }
+  string other_name;
+  struct dirent * dp;
+  while ((dp = readdir(dirp)) != NULL && other_name.empty()) {
+    string name(dp->d_name);
+    if (name == "." || name == "..") {
+      continue;
+    }
+    struct stat entry_info;
+    bool is_csv = name.size() > 4 && name.compare(name.size() - 4, 4, ".csv") == 0 &&
+                  lstat((path + "/" + name).c_str(), &entry_info) == 0 && S_ISREG(entry_info.st_mode);
+    if (!is_csv) {
+      other_name = name;
+    }
+  }
+  closedir(dirp);
+  if (!other_name.empty()) {
+    cerr << path << " holds " << other_name << ", which is not written by NBSfM."
+         << " Choose an empty or a new folder." << endl;
+    return false;
+  }
+  return true;
+}
+
+bool WorkspaceWriter::WriteMarker(string path) {
+  // Marks a temporary folder with the host and process which own it
+  char host_name[256] = {0};
+  gethostname(host_name, sizeof(host_name) - 1);
+  ofstream file(path + "/" + kMarkerName);
+  file << host_name << endl << getpid() << endl;
+  file.close();
+  return !file.fail();
+}
+
+bool WorkspaceWriter::IsStale(string path, pid_t pid) {
+  // Only a folder marked by a dead process of this host is stale. Processes
+  // of other hosts sharing the workspace cannot be checked.
+  ifstream file(path + "/" + kMarkerName);
+  string marker_host_name;
+  pid_t marker_pid = 0;
+  if (!(file >> marker_host_name >> marker_pid)) {
+    return false;
+  }
+  char host_name[256] = {0};
+  gethostname(host_name, sizeof(host_name) - 1);
+  return marker_host_name == host_name && marker_pid == pid &&
+         kill(pid, 0) != 0 && errno == ESRCH;
+}
+
+void WorkspaceWriter::RemoveStale(string parent_path) {
+  // Temporary folders are named <stage>.tmp.<pid> or <stage>.old.<pid>
+  const vector< string > stage_names = {"features", "matched_features", "tracks",
+                                        "matched_features_undistorted", "tracks_undistorted"};
+  DIR* dirp = opendir(parent_path.c_str());
+  if (dirp == NULL) {
+    return;
+  }
+  vector< string > stale_paths;
+  struct dirent * dp;
+  while ((dp = readdir(dirp)) != NULL) {
+    string name(dp->d_name);
+    size_t pos = name.rfind(".tmp.");
+    if (pos == string::npos) {
+      pos = name.rfind(".old.");
+    }
+    if (pos == string::npos ||
+        find(stage_names.begin(), stage_names.end(), name.substr(0, pos)) == stage_names.end()) {
+      continue;
+    }
+    string pid_str = name.substr(pos + 5);
+    if (pid_str.empty() || pid_str.find_first_not_of("0123456789") != string::npos) {
+      continue;
+    }
+    pid_t pid = atoi(pid_str.c_str());
+    if (IsStale(parent_path + "/" + name, pid)) {
+      stale_paths.push_back(parent_path + "/" + name);
+    }
+  }
+  closedir(dirp);
+
+  for (auto stale_path : stale_paths) {
+    cout << "Remove output of an interrupted run : " << stale_path << endl;
+    RemoveDir(stale_path);
+  }
+}
+
 int main(int argc, char * argv[]) {
   NBSfM(argc, argv);
   return 0;
@@ -1,9 +1,15 @@
 #ifndef NBSfM_hpp
 #define NBSfM_hpp
 
+#include <climits>
+#include <cstdint>
+#include <deque>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <unordered_map>
 #include "opencv2/opencv.hpp"
 #include <unistd.h>
 
@@ -13,8 +19,211 @@ using namespace cv;
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 typedef std::vector<std::string> StringVec;
 
+// Run body(i) for every i in [begin, end) on OpenCV worker threads
+template< typename Body >
+class ParallelLoop : public ParallelLoopBody {
+ public:
+  explicit ParallelLoop(const Body& body) : body_(body) {}
+  void operator()(const Range& range) const {
+    for (int i = range.start; i < range.end; i++) {
+      body_(i);
+    }
+  }
+ private:
+  Body body_;
+};
+
+template< typename Body >
+void ParallelFor(int begin, int end, const Body& body) {
+  parallel_for_(Range(begin, end), ParallelLoop< Body >(body));
+}
+
+// DIS optical flow is in the video module since OpenCV 3.4.2
+#if CV_VERSION_MAJOR > 3 || (CV_VERSION_MAJOR == 3 && CV_VERSION_MINOR == 4 && CV_VERSION_REVISION >= 2)
+#define NBSFM_HAVE_DIS_OPTICAL_FLOW
+#endif
+
+// Address and size of a buffer. They change when the buffer is (re)allocated,
+// except when the allocator returns the same address for the same size.
+struct BufferStorage {
+  uintptr_t data;
+  size_t size;
+};
+
+// Tracks reference features to an image (forward) and from the image back to
+// the reference image (backward). Each worker owns its tracker.
+class FeatureTracker {
+ public:
+  virtual ~FeatureTracker() {}
+  virtual string GetName() const = 0;
+  // Track points of the reference image to gray
+  virtual void Forward(const Mat& gray, const vector< Point2f >& points, vector< Point2f >& forward_points,
+                       vector< unsigned char >& status, vector< float >& error) = 0;
+  // Track points of the last gray given to Forward() back to the reference image
+  virtual void Backward(const vector< Point2f >& points, vector< Point2f >& backward_points,
+                        vector< unsigned char >& status, vector< float >& error) = 0;
+  // Storage of internal buffers
+  virtual BufferStorage GetStorage() const = 0;
+};
+
+// Sparse pyramidal Lucas-Kanade
+class KLTTracker : public FeatureTracker {
+ public:
+  KLTTracker(const vector< Mat >& reference_pyramid, Size window_size, int max_level);
+  // image_pyramid_ may point to pyramid_, which a copy would not own
+  KLTTracker(const KLTTracker&) = delete;
+  KLTTracker& operator=(const KLTTracker&) = delete;
+  string GetName() const { return "klt"; }
+  void Forward(const Mat& gray, const vector< Point2f >& points, vector< Point2f >& forward_points,
+               vector< unsigned char >& status, vector< float >& error);
+  // Same as Forward() for an image whose pyramid is already built with the same
+  // window size and max level. The pyramid is used until the next Forward().
+  void ForwardPyramid(const vector< Mat >& pyramid, const vector< Point2f >& points,
+                      vector< Point2f >& forward_points, vector< unsigned char >& status,
+                      vector< float >& error);
+  void Backward(const vector< Point2f >& points, vector< Point2f >& backward_points,
+                vector< unsigned char >& status, vector< float >& error);
+  BufferStorage GetStorage() const;
+
+ private:
+  vector< Mat > reference_pyramid_;
+  vector< Mat > pyramid_;
+  // Pyramid of the last image given to Forward(), pyramid_ or a shared one
+  const vector< Mat > * image_pyramid_;
+  Size window_size_;
+  int max_level_;
+};
+
+// Dense optical flow computed once per image and direction, sampled at points
+class DenseFlowTracker : public FeatureTracker {
+ public:
+  DenseFlowTracker(const Mat& reference_gray, Size window_size, int max_level);
+  string GetName() const;
+  void Forward(const Mat& gray, const vector< Point2f >& points, vector< Point2f >& forward_points,
+               vector< unsigned char >& status, vector< float >& error);
+  void Backward(const vector< Point2f >& points, vector< Point2f >& backward_points,
+                vector< unsigned char >& status, vector< float >& error);
+  BufferStorage GetStorage() const;
+
+ private:
+  void ComputeFlow(const Mat& from, const Mat& to, Mat& flow);
+  bool Sample(const Mat& image, Point2f p, float& value) const;
+  bool SampleFlow(const Mat& flow, Point2f p, Point2f& q) const;
+
+  Mat reference_gray_;
+  Mat gray_;
+  Mat forward_flow_;
+  Mat backward_flow_;
+  bool is_backward_flow_ready_;
+  Size window_size_;
+  int max_level_;
+#ifdef NBSFM_HAVE_DIS_OPTICAL_FLOW
+  Ptr< DISOpticalFlow > dis_;
+#endif
+};
+
+// Buffers of one tracking worker. They keep their storage between images, so
+// after the first image of a worker they are only reallocated when the number
+// of points grows. OpenCV still allocates its own scratch inside cvtColor() and
+// calcOpticalFlowPyrLK() on every call, which is not counted.
+struct TrackingScratch {
+  static const int kNumBuffers = 11;
+
+  Ptr< FeatureTracker > tracker;
+  double forward_time;
+  double backward_time;
+
+  // Backward check statistics
+  int num_verified;
+  int num_skipped;
+  int num_audited;
+  int num_audit_failures;
+
+  Mat gray;
+  vector< Point2f > features_forward;
+  vector< Point2f > features_backward;
+  vector< unsigned char > status_forward;
+  vector< unsigned char > status_backward;
+  vector< float > error_forward;
+  vector< float > error_backward;
+  // 1 if a feature is matched on the image
+  vector< unsigned char > mask;
+  // Features which are tracked backward by selective backward check
+  vector< int > verify_idx;
+  vector< Point2f > verify_points;
+
+  TrackingScratch() :
+      forward_time(0),
+      backward_time(0),
+      num_verified(0),
+      num_skipped(0),
+      num_audited(0),
+      num_audit_failures(0) {}
+
+  void ResetStatistics() {
+    forward_time = 0;
+    backward_time = 0;
+    num_verified = 0;
+    num_skipped = 0;
+    num_audited = 0;
+    num_audit_failures = 0;
+  }
+
+  void GetStorage(BufferStorage storage[kNumBuffers]) const {
+    storage[0] = { (uintptr_t)gray.data, gray.total() * gray.elemSize() };
+    storage[1] = (tracker) ? tracker->GetStorage() : BufferStorage{ 0, 0 };
+    storage[2] = { (uintptr_t)features_forward.data(), features_forward.capacity() };
+    storage[3] = { (uintptr_t)features_backward.data(), features_backward.capacity() };
+    storage[4] = { (uintptr_t)status_forward.data(), status_forward.capacity() };
+    storage[5] = { (uintptr_t)status_backward.data(), status_backward.capacity() };
+    storage[6] = { (uintptr_t)error_forward.data(), error_forward.capacity() };
+    storage[7] = { (uintptr_t)error_backward.data(), error_backward.capacity() };
+    storage[8] = { (uintptr_t)mask.data(), mask.capacity() };
+    storage[9] = { (uintptr_t)verify_idx.data(), verify_idx.capacity() };
+    storage[10] = { (uintptr_t)verify_points.data(), verify_points.capacity() };
+  }
+};
+
+// Writes the files of a workspace stage into a temporary folder next to the
+// stage folder and swaps it in with a rename on Commit(). The stage folder is
+// then either the old or the new one, never a half-written one. A temporary
+// folder holds a marker file with its host and process, and a marked folder
+// left by a dead process of this host marks a partial run. A stage folder which
+// holds anything else than .csv files is never replaced.
+class WorkspaceWriter {
+ public:
+  explicit WorkspaceWriter(string folder_path);
+  ~WorkspaceWriter();
+
+  bool Begin();
+  string GetPath(string file_name);
+  bool Commit();
+
+  static bool MakeDir(string path);
+  static bool RemoveDir(string path);
+  static void RemoveStale(string parent_path);
+
+ private:
+  static constexpr const char * kMarkerName = ".nbsfm_tmp";
+  static bool IsReplaceable(string path);
+  static bool WriteMarker(string path);
+  static bool IsStale(string path, pid_t pid);
+
+  string folder_path_;
+  string temporary_path_;
+  vector< string > file_names_;
+  bool is_begun_;
+};
+
 class NBSfM {
  private:
   // Parameters ====================
@@ -40,6 +249,60 @@ class NBSfM {
   // Each step
   bool redo_feature_detection_;
   bool redo_feature_matching_;
+
+  // Feature detection
+  int max_num_features_;
+  double quality_level_;
+  double min_distance_;
+  int block_size_;
+
+  // Feature matching
+  string tracker_type_;
+  int window_size_;
+  int max_level_;
+  double bidirectional_threshold_;
+  bool is_use_selective_backward_;
+  double forward_error_threshold_;
+  double audit_rate_;
+  bool is_use_pruning_;
+
+  // Sparse tracks
+  bool is_use_sparse_tracks_;
+  int min_track_length_;
+  string track_folder_path_;
+
+  // Region of interest
+  bool is_use_roi_;
+  string roi_mask_path_;
+
+  // Camera
+  bool is_use_camera_;
+  string camera_path_;
+  string undistorted_matched_feature_folder_path_;
+  string undistorted_track_folder_path_;
+
+  // Chunks
+  bool is_use_chunks_;
+  bool is_use_merge_chunks_;
+  int chunk_size_;
+  int chunk_overlap_;
+  int num_chunk_processes_;
+  double link_threshold_;
+  string chunk_folder_path_;
+  string program_path_;
+
+  // Benchmark
+  bool is_use_benchmark_;
+  int benchmark_num_frames_;
+
+  // Sweep
+  bool is_use_sweep_;
+  string sweep_grid_path_;
+
+  // Stream
+  bool is_use_stream_;
+  string stream_source_;
+  double stream_idle_timeout_;
   // Parameters ====================
 
   // Data ==========================
@@ -48,6 +311,11 @@ class NBSfM {
   int image_width_;
   int image_height_;
 
+  // Images are cropped to roi_ when they are loaded. Features are in full image
+  // coordinates, and roi_.tl() is the offset of the cropped images.
+  Rect roi_;
+  Mat roi_mask_;
+
   // Features
   vector< string > feature_paths_;
   Mat features_;
@@ -57,6 +325,44 @@ class NBSfM {
   vector< string > matched_feature_paths_;
   Mat matched_features_;
   int num_matched_features_;
+
+  // Sparse tracks in CSR form. Track k is observed from frame
+  // track_first_frames_[k] on, and its observations are
+  // track_points_[track_offsets_[k]] .. track_points_[track_offsets_[k + 1] - 1].
+  vector< int > track_first_frames_;
+  vector< int > track_offsets_;
+  vector< Point2f > track_points_;
+  int num_tracks_;
+
+  // Camera
+  Mat camera_matrix_;
+  Mat distortion_coefficients_;
+  // Undistorted position of every pixel, (image_width_ + 1) x (image_height_ + 1)
+  Mat undistortion_map_;
+  Mat undistorted_matched_features_;
+  vector< Point2f > undistorted_track_points_;
+
+  // Feature matching buffers, reused between images and runs
+  Mat reference_gray_;
+  vector< Mat > reference_pyramid_;
+  vector< Point2f > reference_features_;
+  // Features which are still tracked and their reference points
+  vector< int > live_idx_;
+  vector< Point2f > live_features_;
+  vector< int > match_counts_;
+  vector< int > track_lengths_;
+  vector< Point2f > observations_;
+  vector< TrackingScratch > tracking_scratch_;
+
+  // Chunks
+  vector< string > chunk_names_;
+  vector< int > chunk_first_frames_;
+  vector< int > chunk_num_frames_;
+
+  // Stream from an image folder, its notifications and images not read yet
+  // with their arrival ticks
+  int stream_watch_fd_;
+  deque< pair< string, double > > stream_pending_images_;
   // Data ==========================
 
   // Parameter functions  ==========
@@ -67,6 +373,7 @@ class NBSfM {
   bool CheckImagesInFolder();
   bool CheckFeatures();
   bool CheckMatchedFeatures();
+  bool CheckTracks();
   void Help(int argc, char *argv[]);
   // Parameter functions  ==========
 
@@ -79,12 +386,15 @@ class NBSfM {
   bool IsFileWritable(string path);
   vector< vector < string > > ReadCSV(string csv_path);
   bool CSVStr2Mat(vector< vector < string > > data, Mat& mat);
+  bool ReadTracks(string track_path, int num_images, vector< int >& first_frames,
+                  vector< int >& offsets, vector< Point2f >& points);
   string GetNameFromPath(string path);
   // Helper functions ==============
 
   // 3D reconstruction functions ===
   bool ExportVideoFrames();
   bool LoadImages();
+  bool SetROI(const Mat& image);
   bool WriteReferenceImage();
 
   bool LoadFeatures();
@@ -93,11 +403,57 @@ class NBSfM {
 
   bool LoadMatchedFeatures();
   bool FeatureMatching();
-  bool WriteMatchedFeatures();
+  Ptr< FeatureTracker > CreateTracker();
+  void BuildReferencePyramid();
+  void InitMatching();
+  int TrackImage(const Mat& image, int image_idx, const vector< Point2f >& points, TrackingScratch& scratch);
+  void TrackPyramid(int image_idx, const vector< Mat >& pyramid, const vector< Point2f >& points,
+                    TrackingScratch& scratch);
+  void CheckBackward(int image_idx, const vector< Point2f >& points, TrackingScratch& scratch);
+  void CollectMatches(int image_idx, const TrackingScratch& scratch);
+  void PruneFeatures(int last_image);
+  bool FinishMatching();
+  bool WriteMatchedFeatures(string matched_feature_folder_path, const Mat& matched_features);
+
+  bool BuildTracks(const vector< int >& track_lengths, const vector< Point2f >& observations);
+  bool LoadTracks();
+  bool WriteTracks(string track_folder_path, const vector< Point2f >& track_points);
+
+  bool LoadCamera();
+  bool BuildUndistortionMap();
+  void UndistortPoints(const Point2f * points, Point2f * undistorted_points, int num_points);
+  bool Undistortion();
 
   bool WriteFeatureImage();
   // 3D reconstruction functions ===
 
+  // Chunk functions ===============
+  bool MakeChunks();
+  bool ReadChunks();
+  vector< string > GetChunkArguments(string chunk_path);
+  bool RunChunks();
+  bool MergeChunks();
+  bool UndistortMergedTracks();
+  // Chunk functions ===============
+
+  // Benchmark functions ===========
+  bool RenderSyntheticScene(int num_frames, vector< Mat >& homographies);
+  double ComputeTrackingRMSE(const vector< Mat >& homographies);
+  bool RunBenchmark();
+  // Benchmark functions ===========
+
+  // Sweep functions ===============
+  bool ReadSweepGrid(const vector< string >& names, vector< vector< double > >& grid);
+  bool RunSweep();
+  // Sweep functions ===============
+
+  // Stream functions ==============
+  void ScanStreamFolder(const string& last_image_name, double tick);
+  bool ReadStreamEvents(int timeout, const string& last_image_name);
+  bool ReadStreamFrame(VideoCapture& capture, string& last_image_name, Mat& frame, double& arrival_tick);
+  bool RunStream();
+  // Stream functions ==============
+
  public:
   NBSfM(int argc, char * argv[]);
 };